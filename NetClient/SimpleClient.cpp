@@ -15,6 +15,18 @@ enum class CustomMsgTypes : uint32_t
 class CustomClient : public kim::net::client_interface<CustomMsgTypes>
 {
 public:
+    CustomClient()
+    {
+        // Messages are handled by OnMessage as they arrive, no need to poll Incoming()
+        EnableInlineDispatch();
+    }
+
+    ~CustomClient()
+    {
+        // Stop the context thread before this object goes, as it calls OnMessage
+        Disconnect();
+    }
+
     void PingServer()
     {
         kim::net::message<CustomMsgTypes> msg;
@@ -34,6 +46,38 @@ public:
         m_connection->Send(msg);
     }
 
+protected:
+    // Runs on the context thread
+    void OnMessage(kim::net::message<CustomMsgTypes> &msg) override
+    {
+        switch (msg.header.id) {
+            case CustomMsgTypes::ServerAccept:
+            {
+                // Server has the accepted connection
+                std::cout << "Server Accepted Connection\n";
+                break;
+            }
+
+            case CustomMsgTypes::ServerPing:
+            {
+                // Server has responded to a ping request
+                std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
+                std::chrono::system_clock::time_point timeThen;
+                msg >> timeThen;
+                std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << "\n";
+                break;
+            }
+
+            case CustomMsgTypes::ServerMessage:
+            {
+                // Server has responded to a ping request
+                uint64_t clientID;
+                msg >> clientID;
+                std::cout << "Hello from [" << clientID << "]\n";
+                break;
+            }
+        }
+    }
 };
 
 int main()
@@ -61,39 +105,7 @@ int main()
             old_key[i] = key[i];
         }
 
-        if (c.IsConnected()) {
-            if (!c.Incoming().empty()) {
-                auto msg = c.Incoming().pop_front().msg;
-
-                switch (msg.header.id) {
-                    case CustomMsgTypes::ServerAccept:
-                    {
-                        // Server has the accepted connection
-                        std::cout << "Server Accepted Connection\n";
-                        break;
-                    }
-
-                    case CustomMsgTypes::ServerPing:
-                    {
-                        // Server has responded to a ping request
-                        std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-                        std::chrono::system_clock::time_point timeThen;
-                        msg >> timeThen;
-                        std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << "\n";
-                        break;
-                    }
-
-                    case CustomMsgTypes::ServerMessage:
-                    {
-                        // Server has responded to a ping request
-                        uint32_t clientID;
-                        msg >> clientID;
-                        std::cout << "Hello from [" << clientID << "]\n";
-                        break;
-                    }
-                }
-            }
-        } else {
+        if (!c.IsConnected()) {
             std::cout << "Server Down\n";
             bQuit = true;
         }
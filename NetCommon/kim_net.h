@@ -1,8 +1,18 @@
 #pragma once
 
 #include "net_common.h"
+#include "net_bufferpool.h"
 #include "net_message.h"
 #include "net_client.h"
 #include "net_connection.h"
 #include "net_server.h"
+#include "net_waitpolicy.h"
 #include "net_tsqueue.h"
+#include "net_mpscqueue.h"
+#include "net_slotmap.h"
+#include "net_compress.h"
+#include "net_udp.h"
+#include "net_shm.h"
+#include "net_handlermemory.h"
+#include "net_dispatch.h"
+#include "net_handlertable.h"
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "net_common.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Snapshot of the buffer pool counters. Once a workload has warmed up the pool,
+        // nHeapAllocations should stop growing - every buffer is then a recycled one
+        struct buffer_pool_stats
+        {
+            // Buffers handed out from a free list
+            uint64_t nPoolAllocations = 0;
+            // Buffers that had to come from the heap (empty free list or oversized request)
+            uint64_t nHeapAllocations = 0;
+            // Buffers given back to a free list
+            uint64_t nPoolReleases = 0;
+            // Buffers given back to the heap (free list full or oversized request)
+            uint64_t nHeapReleases = 0;
+        };
+
+        // Process wide pool of byte buffers in power of two size classes from 64 bytes to 1 MB
+        // Each class is a free list behind its own mutex, so a buffer can be allocated on an
+        // I/O thread and released on a dispatch thread. Bigger requests go straight to the heap
+        class buffer_pool
+        {
+        public:
+            static constexpr size_t nMinBlockSize = 64;
+            static constexpr size_t nClassCount = 15;
+            static constexpr size_t nMaxBlockSize = nMinBlockSize << (nClassCount - 1);
+
+            // Upper bound on the bytes kept idle in each size class
+            static constexpr size_t nMaxCachedBytes = 4 * 1024 * 1024;
+
+            // The pool is never destroyed, so buffers held by static objects
+            // can still be released while the program shuts down
+            static buffer_pool &instance()
+            {
+                static buffer_pool *pool = new buffer_pool();
+                return *pool;
+            }
+
+            void *allocate(size_t nBytes)
+            {
+                size_t nClass = size_class(nBytes);
+                if (nClass == nClassCount) {
+                    m_nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+                    return ::operator new(nBytes);
+                }
+
+                free_list &list = m_lists[nClass];
+                {
+                    std::scoped_lock lock(list.mux);
+                    if (list.pHead) {
+                        block *pBlock = list.pHead;
+                        list.pHead = pBlock->pNext;
+                        list.nCount--;
+                        m_nPoolAllocations.fetch_add(1, std::memory_order_relaxed);
+                        return pBlock;
+                    }
+                }
+
+                m_nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+                return ::operator new(nMinBlockSize << nClass);
+            }
+
+            void deallocate(void *p, size_t nBytes)
+            {
+                size_t nClass = size_class(nBytes);
+                if (nClass < nClassCount) {
+                    free_list &list = m_lists[nClass];
+                    std::scoped_lock lock(list.mux);
+                    if (list.nCount < max_cached(nClass)) {
+                        block *pBlock = static_cast<block *>(p);
+                        pBlock->pNext = list.pHead;
+                        list.pHead = pBlock;
+                        list.nCount++;
+                        m_nPoolReleases.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+
+                m_nHeapReleases.fetch_add(1, std::memory_order_relaxed);
+                ::operator delete(p);
+            }
+
+            buffer_pool_stats stats() const
+            {
+                buffer_pool_stats s;
+                s.nPoolAllocations = m_nPoolAllocations.load(std::memory_order_relaxed);
+                s.nHeapAllocations = m_nHeapAllocations.load(std::memory_order_relaxed);
+                s.nPoolReleases = m_nPoolReleases.load(std::memory_order_relaxed);
+                s.nHeapReleases = m_nHeapReleases.load(std::memory_order_relaxed);
+                return s;
+            }
+
+        private:
+            buffer_pool() = default;
+
+            struct block
+            {
+                block *pNext;
+            };
+
+            struct free_list
+            {
+                std::mutex mux;
+                block *pHead = nullptr;
+                size_t nCount = 0;
+            };
+
+            // Index of the smallest class holding nBytes, nClassCount if none does
+            static size_t size_class(size_t nBytes)
+            {
+                size_t nClass = 0;
+                size_t nSize = nMinBlockSize;
+                while (nSize < nBytes && nClass < nClassCount) {
+                    nSize <<= 1;
+                    nClass++;
+                }
+                return nClass;
+            }
+
+            static size_t max_cached(size_t nClass)
+            {
+                return std::max<size_t>(4, nMaxCachedBytes / (nMinBlockSize << nClass));
+            }
+
+            free_list m_lists[nClassCount];
+
+            std::atomic<uint64_t> m_nPoolAllocations{ 0 };
+            std::atomic<uint64_t> m_nHeapAllocations{ 0 };
+            std::atomic<uint64_t> m_nPoolReleases{ 0 };
+            std::atomic<uint64_t> m_nHeapReleases{ 0 };
+        };
+
+        // Standard allocator drawing from the buffer pool, used for message bodies
+        template<typename U>
+        struct pool_allocator
+        {
+            typedef U value_type;
+
+            pool_allocator() noexcept = default;
+
+            template<typename V>
+            pool_allocator(const pool_allocator<V> &) noexcept {}
+
+            U *allocate(size_t n)
+            {
+                return static_cast<U *>(buffer_pool::instance().allocate(n * sizeof(U)));
+            }
+
+            void deallocate(U *p, size_t n) noexcept
+            {
+                buffer_pool::instance().deallocate(p, n * sizeof(U));
+            }
+
+            template<typename V>
+            bool operator == (const pool_allocator<V> &) const noexcept { return true; }
+
+            template<typename V>
+            bool operator != (const pool_allocator<V> &) const noexcept { return false; }
+        };
+    }
+}
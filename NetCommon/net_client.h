@@ -2,6 +2,8 @@
 
 #include "net_common.h"
 #include "net_tsqueue.h"
+#include "net_connection.h"
+#include "net_udp.h"
 
 namespace kim
 {
@@ -34,6 +36,24 @@ namespace kim
 
                     // Create connection
                     m_connection = std::make_unique<connection<T>>(connection<T>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn);
+                    m_connection->SetMaxFrameSize(m_nMaxFrameSize);
+                    m_connection->SetStreaming(m_nStreamPieceSize);
+                    m_connection->SetFileDirectory(m_strFileDirectory);
+                    if (m_bCompression) m_connection->EnableCompression(m_nCompressThreshold);
+                    if (m_bCoroutines) m_connection->EnableCoroutines();
+                    if (m_bInlineDispatch) {
+                        m_connection->SetMessageHandler([this](std::shared_ptr<connection<T>>, message<T> &msg)
+                            {
+                                OnMessage(msg);
+                            });
+                    }
+                    m_connection->EnableSharedMemory(m_nShmRingSize);
+                    if (m_bUnreliable) {
+                        m_pUdp = std::make_shared<udp_channel<T>>(m_context);
+                        m_pUdp->Open(asio::ip::udp::endpoint(asio::ip::udp::v4(), 0));
+                        m_pUdp->Start();
+                        m_connection->SetUnreliableChannel(m_pUdp);
+                    }
 
                     // Tell the connection object to connect to server
                     m_connection->ConnectToServer(endpoints);
@@ -51,19 +71,25 @@ namespace kim
             // Disconnect from server
             void Disconnect()
             {
-                // If connection exists, and it's connected:
-                if (IsConnected()) {
-                    // Disconnect from server gracefully
-                    m_connection->Disconnect();
-                }
+                // The shared memory threads deliver to OnMessage, so they are stopped and waited for
+                // first, whether or not the socket is still open
+                if (m_connection) m_connection->StopSharedMemory();
 
                 // Done with ASIO context
                 m_context.stop();
                 // Done with thread
                 if (thrContext.joinable()) thrContext.join();
 
+                // The connection's pending operations live in its handler memory, and closing its
+                // socket only queues them, so run them before the connection goes
+                if (m_connection) {
+                    m_connection->Disconnect();
+                    m_context.restart();
+                    m_context.poll();
+                }
+
                 // Destroy the connection object
-                m_connection.release();
+                m_connection.reset();
             }
 
             // Check if client is actually connected to a server
@@ -73,18 +99,117 @@ namespace kim
                 else return false;
             }
 
-            void Send(const message<T> &msg)
+            // Returns false if the message was refused or the connection is congested
+            bool Send(const message<T> &msg, message_priority priority = message_priority::normal)
+            {
+                if (IsConnected()) return m_connection->Send(msg, priority);
+                else return false;
+            }
+
+            // Send a state update, replacing any update with the same key that has not gone out yet
+            bool SendLatest(const message<T> &msg, uint64_t nKey, message_priority priority = message_priority::normal)
+            {
+                if (IsConnected()) return m_connection->SendLatest(msg, nKey, priority);
+                else return false;
+            }
+
+            // Send a state update over the unreliable channel, see connection::SendUnreliable
+            bool SendUnreliable(const message<T> &msg)
+            {
+                if (IsConnected()) return m_connection->SendUnreliable(msg);
+                else return false;
+            }
+
+            // Offer a shared memory transport to a server on this host, set before connecting
+            // (see connection::EnableSharedMemory)
+            void EnableSharedMemory(size_t nRingBytes = 1024 * 1024)
+            {
+                m_nShmRingSize = nRingBytes;
+            }
+
+            // Offer the server an unreliable UDP channel, set before connecting
+            void EnableUnreliable()
+            {
+                m_bUnreliable = true;
+            }
+
+            // Incoming body limit and streaming piece size, set before connecting
+            // (see connection::SetMaxFrameSize and connection::SetStreaming)
+            void SetMaxFrameSize(size_t nBytes)
+            {
+                m_nMaxFrameSize = nBytes;
+            }
+
+            void SetStreaming(size_t nBytes)
             {
-                if (IsConnected()) m_connection->Send(msg);
+                m_nStreamPieceSize = nBytes;
+            }
+
+            // Directory received files are written to, see connection::SetFileDirectory
+            void SetFileDirectory(const std::string &strDirectory)
+            {
+                m_strFileDirectory = strDirectory;
+            }
+
+            // Offer compression to the server, set before connecting (see connection::EnableCompression)
+            void EnableCompression(size_t nThreshold = 1024)
+            {
+                m_bCompression = true;
+                m_nCompressThreshold = nThreshold;
+            }
+
+            // Run the connection with the coroutine engine, set before connecting
+            // (see connection::EnableCoroutines)
+            void EnableCoroutines()
+            {
+                m_bCoroutines = true;
+            }
+
+            // Have OnMessage called as each message arrives, instead of queueing it for Incoming().
+            // It is called on the context thread, and also on the shared memory reader thread once
+            // the connection has moved to shared memory, so two calls may overlap (see
+            // connection::SetMessageHandler). Set before connecting. A derived client should call
+            // Disconnect() in its own destructor, so no message arrives while it is torn down
+            void EnableInlineDispatch()
+            {
+                m_bInlineDispatch = true;
+            }
+
+            // What compression has saved and cost so far
+            compression_stats GetCompressionStats() const
+            {
+                if (m_connection) return m_connection->GetCompressionStats();
+                else return compression_stats();
+            }
+
+            // Where the connection's completion handlers got their memory
+            handler_memory_stats GetHandlerStats() const
+            {
+                if (m_connection) return m_connection->GetHandlerStats();
+                else return handler_memory_stats();
+            }
+
+            // Async: Send the content of a file, see connection::SendFile
+            bool SendFile(T msgId, const std::string &strPath)
+            {
+                if (IsConnected()) return m_connection->SendFile(msgId, strPath);
+                else return false;
             }
 
             // Retireve queue of messages from server
-            tsqueue<kim::net::owned_message<T>> &Incoming()
+            incoming_queue<T> &Incoming()
             {
                 return m_qMessagesIn;
             }
 
         protected:
+            // Called with each message from the server when dispatching inline, see EnableInlineDispatch().
+            // The message is lent for the call and may be moved from. Calls may come from more than one thread
+            virtual void OnMessage([[maybe_unused]] message<T> &msg)
+            {
+
+            }
+
             // ASIO context handles the data transfer
             asio::io_context m_context;
             // ASIO context needs a thread of its own to execute its work commands
@@ -93,10 +218,22 @@ namespace kim
             // asio::ip::tcp::socket m_socket;
             // Client has a single instance of a "connection" object, which handles data transfer
             std::unique_ptr<connection<T>> m_connection;
+            // Settings handed to the connection when it is made
+            size_t m_nMaxFrameSize = connection<T>::nDefaultMaxFrameSize;
+            size_t m_nStreamPieceSize = 0;
+            std::string m_strFileDirectory;
+            bool m_bCompression = false;
+            size_t m_nCompressThreshold = 0;
+            bool m_bUnreliable = false;
+            size_t m_nShmRingSize = 0;
+            bool m_bCoroutines = false;
+            bool m_bInlineDispatch = false;
+            // Datagram socket of the unreliable channel
+            std::shared_ptr<udp_channel<T>> m_pUdp;
 
         private:
             // This is the thread safe queue of incoming messages from server
-            tsqueue<owned_message<T>> m_qMessagesIn;
+            incoming_queue<T> m_qMessagesIn;
         };
     }
 }
\ No newline at end of file
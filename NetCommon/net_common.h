@@ -3,19 +3,54 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <deque>
+#include <unordered_map>
 #include <optional>
 #include <vector>
+#include <array>
+#include <functional>
+#include <string>
+#include <stdexcept>
 #include <iostream>
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
 
 #ifdef _WIN32
 #define _WIN32_WINNT 0x0A00
 #endif
 
+// Zero-copy file transfer: sendfile() on Linux, memory mapped receive on POSIX systems
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define KIM_NET_HAS_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Shared memory transport between processes on one host: POSIX shared memory and futexes
+#if defined(__linux__)
+#define KIM_NET_HAS_SHM
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <climits>
+#endif
+
 #define ASIO_STANDALONE
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
+
+// Coroutine engine, see connection::EnableCoroutines(): needs a compiler and ASIO with C++20 coroutines
+#if defined(ASIO_HAS_CO_AWAIT)
+#define KIM_NET_HAS_COROUTINES
+#endif
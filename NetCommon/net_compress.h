@@ -0,0 +1,194 @@
+#pragma once
+
+#include "net_common.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Small LZ77 codec in the spirit of LZ4: greedy matching through a hash table of recent
+        // 4 byte sequences, byte aligned output and no entropy coding, so it costs little CPU on
+        // either end. A block is a run of sequences, each being a token byte (literal count in the
+        // high nibble, match length - 4 in the low one, 15 meaning more length bytes follow), the
+        // literals, and a 16 bit offset back to the match. The last sequence only has literals
+        class lz_codec
+        {
+        public:
+            // Largest compressed size of nBytes of input
+            static size_t bound(size_t nBytes)
+            {
+                return nBytes + nBytes / 255 + 16;
+            }
+
+            // Compress nSrc bytes into pDst, which must hold bound(nSrc) bytes
+            // Returns the size of the compressed block
+            static size_t compress(const uint8_t *pSrc, size_t nSrc, uint8_t *pDst)
+            {
+                const uint8_t *ip = pSrc;
+                const uint8_t *pAnchor = pSrc;
+                const uint8_t *pEnd = pSrc + nSrc;
+                uint8_t *op = pDst;
+
+                if (nSrc >= nMinMatchInput) {
+                    // Positions are only hints, every candidate is checked before it is used
+                    uint32_t table[size_t(1) << nHashBits] = {};
+
+                    // Matches stop short of the end so the block always finishes with literals
+                    const uint8_t *pMatchLimit = pEnd - nLastLiterals;
+                    const uint8_t *pSearchLimit = pEnd - nMinMatchInput;
+
+                    while (ip < pSearchLimit) {
+                        uint32_t nSequence = read32(ip);
+                        uint32_t &nSlot = table[hash(nSequence)];
+                        const uint8_t *pRef = pSrc + nSlot;
+                        nSlot = uint32_t(ip - pSrc);
+
+                        if (pRef < ip && size_t(ip - pRef) <= nMaxOffset && read32(pRef) == nSequence) {
+                            // Extend the match 8 bytes at a time, then find the first byte that differs
+                            const uint8_t *pMatch = ip + nMinMatch;
+                            const uint8_t *pRefMatch = pRef + nMinMatch;
+                            while (pMatch + 8 <= pMatchLimit && read64(pMatch) == read64(pRefMatch)) {
+                                pMatch += 8;
+                                pRefMatch += 8;
+                            }
+                            while (pMatch < pMatchLimit && *pMatch == *pRefMatch) {
+                                pMatch++;
+                                pRefMatch++;
+                            }
+
+                            op = put_sequence(op, pAnchor, size_t(ip - pAnchor), size_t(ip - pRef), size_t(pMatch - ip) - nMinMatch);
+                            ip = pMatch;
+                            pAnchor = ip;
+                        } else {
+                            // Stride further the longer nothing has matched, so incompressible input stays cheap
+                            ip += 1 + (size_t(ip - pAnchor) >> 6);
+                        }
+                    }
+                }
+
+                // Final sequence: everything left over as literals
+                size_t nLiterals = size_t(pEnd - pAnchor);
+                *op++ = uint8_t(std::min<size_t>(nLiterals, 15) << 4);
+                if (nLiterals >= 15) op = put_length(op, nLiterals - 15);
+                if (nLiterals > 0) std::memcpy(op, pAnchor, nLiterals);
+                op += nLiterals;
+
+                return size_t(op - pDst);
+            }
+
+            // Decompress a block into exactly nDst bytes at pDst
+            // Returns false if the block is malformed or does not decode to nDst bytes
+            static bool decompress(const uint8_t *pSrc, size_t nSrc, uint8_t *pDst, size_t nDst)
+            {
+                const uint8_t *ip = pSrc;
+                const uint8_t *pSrcEnd = pSrc + nSrc;
+                uint8_t *op = pDst;
+                uint8_t *pDstEnd = pDst + nDst;
+
+                for (;;) {
+                    if (ip >= pSrcEnd) return false;
+                    uint8_t nToken = *ip++;
+
+                    size_t nLiterals = nToken >> 4;
+                    if (nLiterals == 15 && !get_length(ip, pSrcEnd, nLiterals)) return false;
+                    if (nLiterals > size_t(pSrcEnd - ip) || nLiterals > size_t(pDstEnd - op)) return false;
+
+                    if (nLiterals > 0) std::memcpy(op, ip, nLiterals);
+                    ip += nLiterals;
+                    op += nLiterals;
+
+                    // Only the last sequence ends right after its literals
+                    if (ip == pSrcEnd) return op == pDstEnd;
+
+                    if (pSrcEnd - ip < 2) return false;
+                    size_t nOffset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+                    ip += 2;
+                    if (nOffset == 0 || nOffset > size_t(op - pDst)) return false;
+
+                    size_t nMatch = nToken & 15;
+                    if (nMatch == 15 && !get_length(ip, pSrcEnd, nMatch)) return false;
+                    nMatch += nMinMatch;
+                    if (nMatch > size_t(pDstEnd - op)) return false;
+
+                    // The match may overlap the bytes it produces, which repeats a short pattern. Copying
+                    // 8 bytes at a time is still right as long as they are 8 or more bytes back
+                    const uint8_t *pRef = op - nOffset;
+                    uint8_t *pMatchEnd = op + nMatch;
+                    if (nOffset >= nMatch) {
+                        std::memcpy(op, pRef, nMatch);
+                    } else if (nOffset >= 8) {
+                        for (; op + 8 <= pMatchEnd; op += 8, pRef += 8) std::memcpy(op, pRef, 8);
+                        while (op < pMatchEnd) *op++ = *pRef++;
+                    } else {
+                        while (op < pMatchEnd) *op++ = *pRef++;
+                    }
+                    op = pMatchEnd;
+                }
+            }
+
+        private:
+            static constexpr size_t nHashBits = 12;
+            static constexpr size_t nMinMatch = 4;
+            static constexpr size_t nMaxOffset = 65535;
+            static constexpr size_t nLastLiterals = 5;
+            static constexpr size_t nMinMatchInput = 12;
+
+            static uint32_t read32(const uint8_t *p)
+            {
+                uint32_t n;
+                std::memcpy(&n, p, sizeof(n));
+                return n;
+            }
+
+            static uint64_t read64(const uint8_t *p)
+            {
+                uint64_t n;
+                std::memcpy(&n, p, sizeof(n));
+                return n;
+            }
+
+            static uint32_t hash(uint32_t nSequence)
+            {
+                return (nSequence * 2654435761u) >> (32 - nHashBits);
+            }
+
+            // Lengths of 15 or more continue in bytes of 255 until a smaller byte ends them
+            static uint8_t *put_length(uint8_t *op, size_t nLength)
+            {
+                while (nLength >= 255) {
+                    *op++ = 255;
+                    nLength -= 255;
+                }
+                *op++ = uint8_t(nLength);
+                return op;
+            }
+
+            static bool get_length(const uint8_t *&ip, const uint8_t *pEnd, size_t &nLength)
+            {
+                uint8_t nByte;
+                do {
+                    if (ip >= pEnd) return false;
+                    nByte = *ip++;
+                    nLength += nByte;
+                } while (nByte == 255);
+                return true;
+            }
+
+            static uint8_t *put_sequence(uint8_t *op, const uint8_t *pLiterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+            {
+                uint8_t *pToken = op++;
+                *pToken = uint8_t((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatch, 15));
+
+                if (nLiterals >= 15) op = put_length(op, nLiterals - 15);
+                std::memcpy(op, pLiterals, nLiterals);
+                op += nLiterals;
+
+                *op++ = uint8_t(nOffset);
+                *op++ = uint8_t(nOffset >> 8);
+
+                if (nMatch >= 15) op = put_length(op, nMatch - 15);
+                return op;
+            }
+        };
+    }
+}
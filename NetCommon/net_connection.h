@@ -2,7 +2,11 @@
 
 #include "net_common.h"
 #include "net_tsqueue.h"
+#include "net_mpscqueue.h"
 #include "net_message.h"
+#include "net_compress.h"
+#include "net_handlermemory.h"
+#include "net_shm.h"
 
 namespace kim
 {
@@ -11,206 +15,1932 @@ namespace kim
         template<typename T>
         class server_interface;
 
+        template<typename T>
+        class udp_channel;
+
+        // Queue that received messages are delivered to. Defining KIM_NET_MPSC_INCOMING swaps
+        // the mutex based tsqueue for the bounded lock-free mpscqueue on this hot path
+#ifdef KIM_NET_MPSC_INCOMING
+        template<typename T>
+        using incoming_queue = mpscqueue<owned_message<T>>;
+#else
+        template<typename T>
+        using incoming_queue = tsqueue<owned_message<T>>;
+#endif
+
+        // What a connection does when its outgoing queue goes past a high watermark
+        enum class overflow_policy
+        {
+            // Queue without limit, the original behaviour
+            none,
+            // Discard the oldest messages that are not being written yet
+            drop_oldest,
+            // Refuse the message being sent
+            drop_newest,
+            // Treat the remote as a slow consumer and close the connection
+            disconnect,
+            // Queue the message, but report congestion to the sender until the queue
+            // drains below the low watermarks
+            signal
+        };
+
+        // Outgoing lanes of a connection. The writer always empties a higher lane
+        // before it takes anything from a lower one
+        enum class message_priority : uint8_t
+        {
+            // Pings, accept/deny, heartbeats
+            control,
+            normal,
+            // Large transfers, the only lane whose bodies may be split into chunks
+            bulk
+        };
+
+        // Per-connection bounds on the outgoing queue. A watermark of 0 is not checked
+        struct outbound_limits
+        {
+            size_t nHighWaterBytes = 0;
+            size_t nLowWaterBytes = 0;
+            size_t nHighWaterCount = 0;
+            size_t nLowWaterCount = 0;
+            overflow_policy policy = overflow_policy::none;
+        };
+
+        // Optional features a connection offers in its handshake. Each side sends the features
+        // it has turned on and a feature is only used when both of them offered it
+        struct connection_caps
+        {
+            // Bodies may be sent compressed, see connection::EnableCompression()
+            static constexpr uint64_t compression = 0x1;
+            // Messages may be sent over a udp_channel, see connection::SendUnreliable()
+            static constexpr uint64_t unreliable = 0x2;
+            // Messages may go through shared memory, see connection::EnableSharedMemory()
+            static constexpr uint64_t shared_memory = 0x4;
+        };
+
+        // What compression has saved and cost a connection, used to tune its threshold
+        struct compression_stats
+        {
+            // Frames sent compressed, and frames left as they were because compressing did not shrink them
+            uint64_t nFramesCompressed = 0;
+            uint64_t nFramesSkipped = 0;
+            // Body bytes of the compressed frames before and after, the ratio being nBytesOut / nBytesIn
+            uint64_t nBytesIn = 0;
+            uint64_t nBytesOut = 0;
+            // Time spent compressing, skipped frames included
+            uint64_t nCompressNs = 0;
+            // Compressed frames received, their body bytes as received and once inflated,
+            // and the time spent inflating them
+            uint64_t nFramesDecompressed = 0;
+            uint64_t nBytesReceived = 0;
+            uint64_t nBytesInflated = 0;
+            uint64_t nDecompressNs = 0;
+        };
+
         template<typename T>
         class connection : public std::enable_shared_from_this<connection<T>>
         {
         public:
             enum class owner
             {
-                server,
-                client
-            };
+                server,
+                client
+            };
+
+            connection(owner parent, asio::io_context &asioContext, asio::ip::tcp::socket socket, incoming_queue<T> &qIn)
+                : m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn), m_timerWrite(m_socket.get_executor()),
+                m_timerHello(m_socket.get_executor())
+            {
+                m_nOwnerType = parent;
+
+                // Construct validation check data
+                if (m_nOwnerType == owner::server) {
+                    // Connection is Server -> Client so construct random data for the 
+                    m_nHandshakeOut = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+
+                    // Pre-calculate the result for checking when the client responds
+                    m_nHandshakeCheck = scramble(m_nHandshakeOut);
+                } else {
+                    // Connection is Client -> Server
+                    m_nHandshakeIn = 0;
+                    m_nHandshakeOut = 0;
+                }
+            }
+            
+            virtual ~connection()
+            {
+                CloseFileIn();
+                StopSharedMemory();
+                if (m_pUdp && m_nDatagramToken != 0) m_pUdp->Unbind(m_nDatagramToken, this);
+            }
+
+            uint64_t GetID() const
+            {
+                return id;
+            }
+
+            void ConnectToClient(kim::net::server_interface<T> *server, uint64_t uid = 0)
+            {
+                if (m_nOwnerType == owner::server) {
+                    if (m_socket.is_open()) {
+                        id = uid;
+
+                        // Solving the handshake proves a client owns the token, so datagrams
+                        // carrying it are accepted from the start
+                        if (m_pUdp) {
+                            m_nDatagramToken = m_nHandshakeCheck;
+                            m_pUdp->Bind(m_nDatagramToken, this);
+                        }
+
+                        // The accepting thread is not the strand, and messages sent from
+                        // OnClientConnect are already on their way there
+                        asio::post(m_socket.get_executor(), [this, self = this->shared_from_this(), server]()
+                            {
+                                OfferSharedMemory();
+
+                                // Write out the handshake data to be validated
+                                WriteValidation();
+
+                                // Wait asynchronously for the validation data
+                                ReadValidation(server);
+                            });
+                    }
+                }
+            }
+
+            // Only called by clients
+            void ConnectToServer(const asio::ip::tcp::resolver::results_type &endpoints)
+            {
+                // Only clients can connect to servers
+                if (m_nOwnerType == owner::client) {
+                    // Request that ASIO attempt to connect to an endpoint
+                    asio::async_connect(m_socket, endpoints,
+                        bind_handler_memory(m_handlerMemory, [this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+                        {
+                            OfferSharedMemory();
+
+                            // Send packet to be validated
+                            ReadValidation();
+                        }));
+                }
+            }
+
+            // Can be called by both clients and servers
+            void Disconnect()
+            {
+                m_bShmStop = true;
+                if (IsConnected()) {
+                    asio::post(m_socket.get_executor(), [this]()
+                        {
+                            m_socket.close();
+                            m_timerHello.cancel();
+                        });
+                }
+            }
+            // Is connection open and active
+            bool IsConnected() const
+            {
+                return m_socket.is_open();
+            }
+
+            // Prime the connection to wait for incoming messages
+            void StartListening()
+            {
+
+            }
+
+            // Async: Send a message on a one-on-one connection with the server
+            // Returns false if the message was refused or the connection is congested
+            bool Send(const message<T> &msg, message_priority priority = message_priority::normal)
+            {
+                // Copy the message once, the queue and the posted job then only share it
+                return Send(make_shared_message(msg), priority);
+            }
+
+            // Async: Queue an immutable message that may be shared with other connections
+            // It is written as-is and released once the last connection holding it has sent it
+            bool Send(shared_message<T> msg, message_priority priority = message_priority::normal)
+            {
+                outgoing_message out;
+                out.msg = std::move(msg);
+                return Queue(std::move(out), priority);
+            }
+
+            // Async: Send a state update where only the newest value per key matters
+            // If a message with the same key is still waiting in the outgoing queue it is
+            // replaced in place, so a slow reader gets the latest value without the backlog
+            // A pending message stays in the lane it was first queued in
+            bool SendLatest(const message<T> &msg, uint64_t nKey, message_priority priority = message_priority::normal)
+            {
+                return SendLatest(make_shared_message(msg), nKey, priority);
+            }
+
+            bool SendLatest(shared_message<T> msg, uint64_t nKey, message_priority priority = message_priority::normal)
+            {
+                outgoing_message out;
+                out.msg = std::move(msg);
+                out.nKey = nKey;
+                out.bLatest = true;
+                return Queue(std::move(out), priority);
+            }
+
+            // Async: Send the content of a file as the body of a message, always in the bulk lane
+            // The file is never loaded whole: on Linux the body goes from the page cache to the
+            // socket with sendfile(), elsewhere it is read a buffer at a time. Returns false if the
+            // file cannot be opened, is over 4 GB, or was refused by the overflow policy
+            bool SendFile(T msgId, const std::string &strPath)
+            {
+                auto file = std::make_shared<file_source>();
+                file->pFile = std::fopen(strPath.c_str(), "rb");
+                if (!file->pFile) return false;
+
+#ifdef _WIN32
+                _fseeki64(file->pFile, 0, SEEK_END);
+                int64_t nSize = _ftelli64(file->pFile);
+#else
+                fseeko(file->pFile, 0, SEEK_END);
+                int64_t nSize = int64_t(ftello(file->pFile));
+#endif
+                if (nSize < 0 || uint64_t(nSize) > UINT32_MAX) return false;
+                file->nSize = uint64_t(nSize);
+
+                message<T> msg;
+                msg.header.id = msgId;
+                msg.header.size = uint32_t(nSize);
+
+                outgoing_message out;
+                out.msg = make_shared_message(std::move(msg));
+                out.file = std::move(file);
+                return Queue(std::move(out), message_priority::bulk);
+            }
+
+            // Write the bodies of incoming SendFile() messages to files in this directory instead of
+            // memory. Each frame is received straight into a memory mapped window of the file, so
+            // the file is never held in user-space buffers and is not bound by the maximum frame
+            // size. The message then delivered has frame_flags::file set and the file's path as
+            // its body. Needs mmap(), elsewhere the bodies are received into memory as usual
+            void SetFileDirectory(const std::string &strDirectory)
+            {
+                m_strFileDirectory = strDirectory;
+            }
+
+            // Bound the outgoing queue, set before the connection starts sending
+            void SetOutboundLimits(const outbound_limits &limits)
+            {
+                m_limits = limits;
+            }
+
+            // Incoming body limit a connection starts with
+            static constexpr size_t nDefaultMaxFrameSize = 16 * 1024 * 1024;
+
+            // Largest body the connection will hold in memory, checked against each header before
+            // any memory is set aside for the body. A chunked message is held to the same bound as
+            // it is put back together. 0 removes the limit. Set before the connection starts reading
+            void SetMaxFrameSize(size_t nBytes)
+            {
+                m_nMaxFrameSize = nBytes;
+            }
+
+            // Deliver bodies larger than nBytes (capped at the receive buffer size) as a run of
+            // messages of at most nBytes each, as soon as each piece has arrived, instead of holding
+            // the whole body first. Pieces are flagged frame_flags::piece, the last one also
+            // frame_flags::last_piece. Chunks from a sender using SetChunkSize() are passed on as
+            // they come, still flagged frame_flags::chunk/last_chunk, rather than put back together
+            // 0 (the default) turns streaming off
+            void SetStreaming(size_t nBytes)
+            {
+                m_nStreamPieceSize = nBytes;
+            }
+
+            // Async: Send a state update over the unreliable channel, where only the newest value per
+            // message id matters. The datagram may be lost, and the remote drops it if it arrives after
+            // a newer one with the same id. Delivered messages carry frame_flags::unreliable. Until
+            // the channel is up on both sides, or if the message does not fit in one datagram, it is
+            // sent with SendLatest() instead, keyed by its id
+            bool SendUnreliable(const message<T> &msg)
+            {
+                const size_t nDatagram = udp_channel<T>::nPrefixSize + sizeof(message_header<T>) + msg.body.size();
+                if (!m_bUdpReady || !(m_nCaps & connection_caps::unreliable) || nDatagram > udp_channel<T>::nMaxDatagramSize) {
+                    return SendLatest(msg, nUnreliableKey | uint64_t(msg.header.id));
+                }
+
+                message_header<T> header = msg.header;
+                header.size = uint32_t(msg.body.size());
+                header.flags = 0;
+                if (!SendDatagram(&header, msg.body.data())) return false;
+
+                m_nDatagramsSent++;
+                return true;
+            }
+
+            // Offer an unreliable channel over this UDP socket, set before connecting
+            void SetUnreliableChannel(std::shared_ptr<udp_channel<T>> pChannel)
+            {
+                m_pUdp = std::move(pChannel);
+                if (m_pUdp) m_nCapsOut |= connection_caps::unreliable;
+            }
+
+            // Handle a datagram carrying this connection's token, called by its udp_channel. A hello
+            // only tells where the remote is: the server learns the client's address from it and
+            // answers, which stops the client's hellos. Messages are delivered unless a newer one
+            // with the same id already was
+            void OnDatagram(const asio::ip::udp::endpoint &remote, const uint8_t *pData, size_t nBytes)
+            {
+                if (m_nOwnerType == owner::server) {
+                    std::scoped_lock lock(m_muxUdp);
+                    m_udpRemote = remote;
+                    m_bUdpReady = true;
+                } else {
+                    m_bHelloAcked = true;
+                }
+
+                uint64_t nSequence;
+                std::memcpy(&nSequence, pData, sizeof(uint64_t));
+                pData += sizeof(uint64_t);
+                nBytes -= sizeof(uint64_t);
+
+                if (nBytes == 0) {
+                    if (m_nOwnerType == owner::server) SendDatagram(nullptr, nullptr);
+                    return;
+                }
+
+                message<T> msg;
+                if (nBytes < sizeof(message_header<T>)) return;
+                std::memcpy(&msg.header, pData, sizeof(message_header<T>));
+                if (msg.header.size != nBytes - sizeof(message_header<T>)) return;
+
+                msg.header.flags = frame_flags::unreliable;
+                msg.body.assign(pData + sizeof(message_header<T>), pData + nBytes);
+
+                // This runs on the channel's receive thread. The caps, the sequence numbers and
+                // delivery belong to the strand, as for messages read over TCP
+                std::shared_ptr<connection<T>> self;
+                if (m_nOwnerType == owner::server) {
+                    self = this->weak_from_this().lock();
+                    if (!self) return;
+                }
+
+                asio::post(m_socket.get_executor(),
+                    [this, self = std::move(self), nSequence, msg = std::move(msg)]() mutable
+                    {
+                        if (!(m_nCaps & connection_caps::unreliable)) return;
+
+                        uint64_t &nLast = m_mapDatagramSequence[uint64_t(msg.header.id)];
+                        if (nSequence <= nLast) {
+                            m_nStaleDatagrams++;
+                            return;
+                        }
+                        nLast = nSequence;
+                        m_nDatagramsReceived++;
+
+                        DeliverMessage(msg);
+                    });
+            }
+
+            // Datagrams sent, datagrams delivered, and datagrams dropped for being older than one delivered
+            uint64_t GetDatagramsSent() const
+            {
+                return m_nDatagramsSent;
+            }
+
+            uint64_t GetDatagramsReceived() const
+            {
+                return m_nDatagramsReceived;
+            }
+
+            uint64_t GetStaleDatagrams() const
+            {
+                return m_nStaleDatagrams;
+            }
+
+            // Offer a shared memory transport with rings of nRingBytes each way, used only with a peer
+            // on this host, reached over loopback, that offered it too. Once both sides have the
+            // segment mapped, messages skip the socket: a writer thread per connection copies what is
+            // sent into one ring, waiting while it is full, and a reader thread delivers what arrives
+            // in the other. Outbound limits apply to the messages waiting for the writer; lanes,
+            // chunking, conflation and compression do not apply. Linux only, elsewhere the connection
+            // stays on TCP. Set before connecting
+            void EnableSharedMemory(size_t nRingBytes = 1024 * 1024)
+            {
+                m_nShmRingSize = nRingBytes;
+            }
+
+            // Whether messages to the remote now go through shared memory
+            bool IsSharedMemory() const
+            {
+                return m_bShmOut;
+            }
+
+            // Stop the shared memory threads and wait for them. A server side connection is kept
+            // alive by its threads until then, so the server calls this, holding the connection,
+            // before it lets go of it. Never call it from a message handler
+            void StopSharedMemory()
+            {
+                m_bShmStop = true;
+#ifdef KIM_NET_HAS_SHM
+                {
+                    std::scoped_lock lock(m_muxShmThreads);
+                    m_bShmJoining = true;
+                }
+
+                if (m_thrShmReader.joinable()) {
+                    m_shm.ring(m_nOwnerType == owner::client ? 1 : 0).wake_reader();
+                    m_thrShmReader.join();
+                }
+
+                m_cvShmOut.notify_all();
+                if (m_thrShmWriter.joinable()) m_thrShmWriter.join();
+#endif
+            }
+
+            // Receives each message on the thread that read it, see SetMessageHandler()
+            using message_handler = std::function<void(std::shared_ptr<connection<T>>, message<T> &)>;
+
+            // Hand received messages straight to handler on the thread that delivers them, instead of
+            // queueing them for the owner to pick up. Messages read over TCP and datagrams are
+            // delivered one at a time on the connection's strand, on an I/O thread. Once the connection
+            // has moved to shared memory, its messages come from the shared memory reader thread,
+            // and the handler may then run there while it also runs on the strand for a datagram.
+            // Handlers of different connections may run at the same time. The message is lent for
+            // the call: the handler may read it or move out of it, but must not hold on to it. The
+            // remote is nullptr on a client. Set before connecting
+            void SetMessageHandler(message_handler handler)
+            {
+                m_fnMessageHandler = std::move(handler);
+            }
+
+            // Move messages with the coroutine engine: one read loop and one write loop per connection,
+            // each a C++20 coroutine suspended on the socket, instead of a chain of completion handlers.
+            // Framing, lanes and every other feature behave the same. Only local to this side, so the
+            // remote may use either engine. Needs a C++20 build (KIM_NET_HAS_COROUTINES), otherwise
+            // the callback engine is used. Set before connecting
+            void EnableCoroutines()
+            {
+                m_bCoroutines = true;
+            }
+
+            // Offer to compress frame bodies. When the remote has offered it too, bodies of at least
+            // nThreshold bytes are compressed with lz_codec as they are written and flagged
+            // frame_flags::compressed; smaller ones, file bodies and bodies that do not shrink go out
+            // as they are. Received messages are always delivered inflated. Set before connecting
+            void EnableCompression(size_t nThreshold = 1024)
+            {
+                m_nCapsOut |= connection_caps::compression;
+                m_nCompressThreshold = std::max<size_t>(nThreshold, 1);
+            }
+
+            // Features both sides offered in the handshake, 0 until it has completed
+            uint64_t GetCaps() const
+            {
+                return m_nCaps;
+            }
+
+            // Where the connection's completion handlers got their memory. The callback engine keeps
+            // them in the connection's handler_memory, the coroutine engine's come from ASIO
+            handler_memory_stats GetHandlerStats() const
+            {
+                return m_handlerMemory.stats();
+            }
+
+            compression_stats GetCompressionStats() const
+            {
+                compression_stats s;
+                s.nFramesCompressed = m_nFramesCompressed;
+                s.nFramesSkipped = m_nFramesUncompressible;
+                s.nBytesIn = m_nCompressBytesIn;
+                s.nBytesOut = m_nCompressBytesOut;
+                s.nCompressNs = m_nCompressNs;
+                s.nFramesDecompressed = m_nFramesDecompressed;
+                s.nBytesReceived = m_nDecompressBytesIn;
+                s.nBytesInflated = m_nDecompressBytesOut;
+                s.nDecompressNs = m_nDecompressNs;
+                return s;
+            }
+
+            // Split bulk lane bodies larger than nBytes into chunks of nBytes, so a big transfer
+            // only holds up control and normal traffic for one chunk at a time. The default of 0
+            // sends every body whole. Set before the connection starts sending
+            void SetChunkSize(size_t nBytes)
+            {
+                m_nChunkSize = nBytes;
+            }
+
+            // Bytes (headers included) and frames sent but not written to the socket yet
+            // A chunked body counts as one frame per chunk
+            size_t GetQueuedBytes() const
+            {
+                return m_nQueuedBytes;
+            }
+
+            size_t GetQueuedCount() const
+            {
+                return m_nQueuedCount;
+            }
+
+            // Set under the signal policy while the queue is above its high watermark
+            // and until it has drained below its low watermarks, and for good once
+            // the disconnect policy has dropped a slow consumer
+            bool IsCongested() const
+            {
+                return m_bCongested;
+            }
+
+            // Messages discarded by the drop_oldest and drop_newest policies
+            uint64_t GetDroppedCount() const
+            {
+                return m_nDroppedCount;
+            }
+
+            // Pending messages superseded by a newer SendLatest with the same key
+            uint64_t GetConflatedCount() const
+            {
+                return m_nConflatedCount;
+            }
+
+            // Number of write calls issued and messages they carried,
+            // so the average number of messages per syscall can be checked
+            uint64_t GetWriteCount() const
+            {
+                return m_nWriteCount;
+            }
+
+            uint64_t GetMessagesWritten() const
+            {
+                return m_nMessagesWritten;
+            }
+
+            // Number of read calls completed and messages they delivered
+            uint64_t GetReadCount() const
+            {
+                return m_nReadCount;
+            }
+
+            uint64_t GetMessagesRead() const
+            {
+                return m_nMessagesRead;
+            }
+
+        private: 
+            // File being sent by SendFile(), closed once the last frame reading from it is written
+            struct file_source
+            {
+                std::FILE *pFile = nullptr;
+                uint64_t nSize = 0;
+
+                ~file_source()
+                {
+                    if (pFile) std::fclose(pFile);
+                }
+
+                // Position the file for reading, with 64 bit offsets everywhere
+                bool seek(uint64_t nOffset)
+                {
+#ifdef _WIN32
+                    return _fseeki64(pFile, int64_t(nOffset), SEEK_SET) == 0;
+#else
+                    return fseeko(pFile, off_t(nOffset), SEEK_SET) == 0;
+#endif
+                }
+            };
+
+            // Entry of the outgoing queue
+            struct outgoing_message
+            {
+                shared_message<T> msg;
+                // Increases along the queue, used to find a keyed entry again
+                uint64_t nSequence = 0;
+                // Conflation key, only used when bLatest is set
+                uint64_t nKey = 0;
+                bool bLatest = false;
+                // Piece of the body this entry writes, and its frame_flags when it is a chunk
+                uint32_t nOffset = 0;
+                uint32_t nLength = 0;
+                uint32_t nFlags = 0;
+                // Where the body comes from when it is sent with SendFile
+                std::shared_ptr<file_source> file;
+            };
+
+            static constexpr size_t nLaneCount = 3;
+
+            // Buffer sequence over m_vWriteBuffers handed to async_write, which keeps a copy of the
+            // sequence it is given for as long as the write lasts. Copying this one allocates nothing
+            struct write_buffers
+            {
+                typedef asio::const_buffer value_type;
+                typedef const asio::const_buffer *const_iterator;
+
+                const_iterator pBegin;
+                const_iterator pEnd;
+
+                const_iterator begin() const
+                {
+                    return pBegin;
+                }
+
+                const_iterator end() const
+                {
+                    return pEnd;
+                }
+            };
+
+            // What the receive side reads next, as decided by ParseFrames()
+            enum class read_step
+            {
+                // More frames into the receive buffer
+                frames,
+                // The rest of a body too large for the receive buffer, straight into the message
+                body,
+                // The rest of a file frame, straight into its mapping
+                file_frame,
+                // Nothing, the connection has been closed
+                stop
+            };
+
+            // Apply the overflow policy and hand the message to the strand, or to the shared memory writer
+            bool Queue(outgoing_message out, message_priority priority)
+            {
+#ifdef KIM_NET_HAS_SHM
+                // Moving to shared memory happens under this lock, see SwitchToSharedMemory(), so a
+                // message is either posted to the strand ahead of the marker or goes through the ring
+                std::unique_lock<std::mutex> lockSwitch(m_muxShmSwitch, std::defer_lock);
+                if (m_nShmRingSize > 0) lockSwitch.lock();
+#endif
+                const bool bShm = m_bShmOut;
+                size_t nLane = size_t(priority);
+                size_t nBody = out.file ? size_t(out.file->nSize) : out.msg->body.size();
+
+                // Only bulk messages are split, and a conflated one has to stay in one piece
+                size_t nChunkSize = m_nChunkSize;
+                size_t nChunks = 1;
+                if (!bShm && priority == message_priority::bulk && !out.bLatest && nChunkSize > 0 && nBody > nChunkSize) {
+                    nChunks = (nBody + nChunkSize - 1) / nChunkSize;
+                }
+                size_t nBytes = nChunks * sizeof(message_header<T>) + nBody;
+
+                // Senders on different threads check and count under one lock, so between them
+                // they cannot take the queue past a high watermark. Only the writing side takes away
+                std::unique_lock<std::mutex> lock(m_muxQueued, std::defer_lock);
+                if (m_limits.nHighWaterBytes > 0 || m_limits.nHighWaterCount > 0) lock.lock();
+
+                if (IsAboveHighWater(nBytes, nChunks)) {
+                    switch (m_limits.policy) {
+                        case overflow_policy::drop_newest:
+                            m_nDroppedCount++;
+                            return false;
+
+                        case overflow_policy::disconnect:
+                            if (!m_bCongested.exchange(true)) {
+                                std::cout << "[" << id << "] Slow Consumer Disconnected\n";
+                                Disconnect();
+                            }
+                            return false;
+
+                        case overflow_policy::signal:
+                            m_bCongested = true;
+                            break;
+
+                        default:
+                            // drop_oldest makes room once the message is on the strand
+                            break;
+                    }
+                }
+
+                m_nQueuedBytes += nBytes;
+                m_nQueuedCount += nChunks;
+                if (lock.owns_lock()) lock.unlock();
+
+#ifdef KIM_NET_HAS_SHM
+                if (bShm) {
+                    QueueSharedMemory(std::move(out), nBytes);
+                    return !m_bCongested;
+                }
+#endif
+
+                // Send a job to the connection's strand, so it never runs alongside a read or write handler
+                asio::post(m_socket.get_executor(),
+                    [this, out = std::move(out), nLane, nBody, nChunks, nChunkSize]() mutable
+                    {
+                        // If there are outgoing messages in queue, then in the background, ASIO is sending
+                        bool bWritingMessage = !IsOutgoingEmpty();
+                        if (out.bLatest && ReplacePending(out)) return;
+
+                        if (nChunks == 1) {
+                            out.nSequence = m_nNextSequence++;
+                            out.nLength = uint32_t(nBody);
+                            if (out.bLatest) m_mapLatest[out.nKey] = out.nSequence;
+                            m_qMessagesOut[nLane].push_back(std::move(out));
+                        } else {
+                            QueueChunks(m_qMessagesOut[nLane], out, nChunkSize);
+                        }
+
+                        if (m_limits.policy == overflow_policy::drop_oldest) DropOldest(nLane);
+                        if (!bWritingMessage) {
+                            StartWriting();
+                        }
+                    });
+
+                return !m_bCongested;
+            }
+
+            // Queue a body as consecutive chunk frames that all share the one message (or file)
+            void QueueChunks(std::deque<outgoing_message> &lane, const outgoing_message &whole, size_t nChunkSize)
+            {
+                uint64_t nBody = whole.file ? whole.file->nSize : whole.msg->body.size();
+
+                for (uint64_t nOffset = 0; nOffset < nBody; nOffset += nChunkSize) {
+                    outgoing_message out;
+                    out.msg = whole.msg;
+                    out.file = whole.file;
+                    out.nSequence = m_nNextSequence++;
+                    out.nOffset = uint32_t(nOffset);
+                    out.nLength = uint32_t(std::min<uint64_t>(nChunkSize, nBody - nOffset));
+                    out.nFlags = frame_flags::chunk | (whole.file ? frame_flags::file : 0);
+                    if (nOffset + out.nLength == nBody) out.nFlags |= frame_flags::last_chunk;
+                    lane.push_back(std::move(out));
+                }
+            }
+
+            bool IsOutgoingEmpty() const
+            {
+                for (const auto &lane : m_qMessagesOut) {
+                    if (!lane.empty()) return false;
+                }
+                return true;
+            }
+
+            static size_t FrameSize(const outgoing_message &out)
+            {
+                return sizeof(message_header<T>) + out.nLength;
+            }
+
+            // Flags a frame goes out with. Only the connection sets them: a message handed back
+            // to Send() after it was received keeps the flags it was delivered with, which say
+            // nothing about how it is sent now
+            static uint32_t FrameFlags(const outgoing_message &out)
+            {
+                if (out.nFlags != 0) return out.nFlags;
+                return out.file ? frame_flags::file : 0;
+            }
+
+            // Would queuing nBytes in nFrames more take the outgoing queue over a high watermark
+            bool IsAboveHighWater(size_t nBytes, size_t nFrames) const
+            {
+                return (m_limits.nHighWaterBytes > 0 && m_nQueuedBytes + nBytes > m_limits.nHighWaterBytes) ||
+                    (m_limits.nHighWaterCount > 0 && m_nQueuedCount + nFrames > m_limits.nHighWaterCount);
+            }
+
+            // Is the outgoing queue below both low watermarks
+            bool IsBelowLowWater() const
+            {
+                return (m_limits.nHighWaterBytes == 0 || m_nQueuedBytes <= m_limits.nLowWaterBytes) &&
+                    (m_limits.nHighWaterCount == 0 || m_nQueuedCount <= m_limits.nLowWaterCount);
+            }
+
+            // Discard the oldest messages not yet handed to the socket until the queue is back
+            // under its high watermarks. Lower lanes lose messages first and the message just
+            // queued in nNewestLane is always kept. Chunks are never dropped, as the remote could
+            // not put their message back together
+            void DropOldest(size_t nNewestLane)
+            {
+                for (size_t n = nLaneCount; n-- > 0 && IsAboveHighWater(0, 0);) {
+                    std::deque<outgoing_message> &lane = m_qMessagesOut[n];
+                    size_t nKeep = m_nLaneInFlight[n] + (n == nNewestLane ? 1 : 0);
+
+                    while (IsAboveHighWater(0, 0) && lane.size() > nKeep) {
+                        auto it = lane.begin() + m_nLaneInFlight[n];
+                        if (it->nFlags != 0) break;
+
+                        m_nQueuedBytes -= FrameSize(*it);
+                        m_nQueuedCount--;
+                        m_nDroppedCount++;
+                        ForgetLatest(*it);
+                        lane.erase(it);
+                    }
+                }
+            }
+
+            // Swap a keyed message into the slot of the pending one with the same key
+            // Returns false if there is none, or it is already being written
+            bool ReplacePending(outgoing_message &out)
+            {
+                auto it = m_mapLatest.find(out.nKey);
+                if (it == m_mapLatest.end()) return false;
+
+                for (size_t n = 0; n < nLaneCount; n++) {
+                    std::deque<outgoing_message> &lane = m_qMessagesOut[n];
+
+                    // Sequence numbers only grow along a lane, so the entry can be found by bisection
+                    auto itPending = std::lower_bound(lane.begin(), lane.end(), it->second,
+                        [](const outgoing_message &queued, uint64_t nSequence) { return queued.nSequence < nSequence; });
+                    if (itPending == lane.end() || itPending->nSequence != it->second) continue;
+                    if (size_t(itPending - lane.begin()) < m_nLaneInFlight[n]) return false;
+
+                    // The new message was counted when it was sent, the old one leaves the queue
+                    m_nQueuedBytes -= FrameSize(*itPending);
+                    m_nQueuedCount--;
+                    m_nConflatedCount++;
+                    itPending->msg = std::move(out.msg);
+                    itPending->nLength = uint32_t(itPending->msg->body.size());
+                    return true;
+                }
+
+                return false;
+            }
+
+            // Drop the key of a message leaving the queue, unless a newer one has taken it over
+            void ForgetLatest(const outgoing_message &out)
+            {
+                if (!out.bLatest) return;
+
+                auto it = m_mapLatest.find(out.nKey);
+                if (it != m_mapLatest.end() && it->second == out.nSequence) m_mapLatest.erase(it);
+            }
+
+            // Callback engine - Prime context to write as many queued messages as fit in the write budget
+            // Headers and bodies of every gathered message go out as one buffer sequence,
+            // so a burst of small messages costs a single writev and a single completion handler
+            void WriteMessages()
+            {
+                bool bFile = GatherMessages();
+
+                // Messages queued while this write is in flight are added to the back of the lanes,
+                // which leaves the buffers of the ones being written untouched
+                asio::async_write(m_socket, write_buffers{ m_vWriteBuffers.data(), m_vWriteBuffers.data() + m_vWriteBuffers.size() },
+                    bind_handler_memory(m_handlerMemory, [this, bFile](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec && bFile) {
+                            WriteFileBody(0);
+                        } else {
+                            OnMessagesWritten(ec);
+                        }
+                    }));
+            }
+
+            // Put the queued messages that fit in the write budget into m_vWriteBuffers
+            // Lanes are gathered in priority order, so a control message queued behind bulk
+            // traffic goes out with the very next write. Returns true if it is the header of a
+            // file frame instead, whose body is then sent from the file
+            bool GatherMessages()
+            {
+                m_vWriteBuffers.clear();
+                m_vChunkHeaders.clear();
+                m_vChunkHeaders.reserve(nMaxWriteBuffers);
+                m_nMessagesInFlight = 0;
+                m_nCompressedInFlight = 0;
+                size_t nBytes = 0;
+                bool bFull = false;
+
+                for (size_t n = 0; n < nLaneCount; n++) {
+                    m_nLaneInFlight[n] = 0;
+
+                    for (const auto &out : m_qMessagesOut[n]) {
+                        size_t nSize = FrameSize(out);
+
+                        // Always send at least one message, no matter how large it is
+                        bFull = bFull || (m_nMessagesInFlight > 0 &&
+                            (nBytes + nSize > nWriteBudget || m_vWriteBuffers.size() + 2 > nMaxWriteBuffers));
+
+                        // A file frame is written on its own, after whatever was gathered before it
+                        if (out.file && !bFull) {
+                            if (m_nMessagesInFlight > 0) {
+                                bFull = true;
+                            } else {
+                                m_nLaneInFlight[n] = 1;
+                                m_nMessagesInFlight = 1;
+                                m_nBytesInFlight = nSize;
+                                m_nWriteCount++;
+                                GatherFileFrame(out);
+                                return true;
+                            }
+                        }
+                        if (bFull) break;
+
+                        nBytes += nSize;
+                        m_nLaneInFlight[n]++;
+                        m_nMessagesInFlight++;
+
+                        if (out.nLength >= m_nCompressThreshold && (m_nCaps & connection_caps::compression) &&
+                            AddCompressedFrame(out)) {
+                            continue;
+                        }
+
+                        if (out.nFlags == 0 && out.msg->header.flags == 0 && out.msg->header.size == out.nLength) {
+                            m_vWriteBuffers.push_back(asio::buffer(&out.msg->header, sizeof(message_header<T>)));
+                        } else {
+                            // A chunk, or a message whose header does not describe what is sent
+                            // (flags left from when it was received, or a size other than its
+                            // body's), gets a header of its own, kept alive until the write completes
+                            message_header<T> header = out.msg->header;
+                            header.size = out.nLength;
+                            header.flags = FrameFlags(out);
+                            m_vChunkHeaders.push_back(header);
+                            m_vWriteBuffers.push_back(asio::buffer(&m_vChunkHeaders.back(), sizeof(message_header<T>)));
+                        }
+                        if (out.nLength > 0) m_vWriteBuffers.push_back(asio::buffer(out.msg->body.data() + out.nOffset, out.nLength));
+                    }
+                }
+
+                m_nBytesInFlight = nBytes;
+                m_nWriteCount++;
+                return false;
+            }
+
+            // Compress the body of a gathered frame into a spare buffer and gather that in its place
+            // The body is prefixed with its original size. Returns false, having gathered nothing,
+            // if compressing did not make it smaller
+            bool AddCompressedFrame(const outgoing_message &out)
+            {
+                if (m_nCompressedInFlight == m_vCompressed.size()) m_vCompressed.emplace_back();
+                std::vector<uint8_t> &vBlock = m_vCompressed[m_nCompressedInFlight];
+                if (vBlock.size() < sizeof(uint32_t) + lz_codec::bound(out.nLength)) {
+                    vBlock.resize(sizeof(uint32_t) + lz_codec::bound(out.nLength));
+                }
+
+                const auto tStart = std::chrono::steady_clock::now();
+                size_t nBlock = sizeof(uint32_t) +
+                    lz_codec::compress(out.msg->body.data() + out.nOffset, out.nLength, vBlock.data() + sizeof(uint32_t));
+                m_nCompressNs += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - tStart).count());
+
+                if (nBlock >= out.nLength) {
+                    m_nFramesUncompressible++;
+                    return false;
+                }
+
+                std::memcpy(vBlock.data(), &out.nLength, sizeof(uint32_t));
+                m_nCompressedInFlight++;
+                m_nFramesCompressed++;
+                m_nCompressBytesIn += out.nLength;
+                m_nCompressBytesOut += nBlock;
+
+                message_header<T> header = out.msg->header;
+                header.size = uint32_t(nBlock);
+                header.flags = FrameFlags(out) | frame_flags::compressed;
+                m_vChunkHeaders.push_back(header);
+                m_vWriteBuffers.push_back(asio::buffer(&m_vChunkHeaders.back(), sizeof(message_header<T>)));
+                m_vWriteBuffers.push_back(asio::buffer(vBlock.data(), nBlock));
+                return true;
+            }
+
+            // Send a datagram with a message, or a hello when pHeader is null
+            bool SendDatagram(const message_header<T> *pHeader, const uint8_t *pBody)
+            {
+                uint64_t nPrefix[2] = { m_nDatagramToken, pHeader ? ++m_nDatagramSequence : 0 };
+                std::array<asio::const_buffer, 3> buffers = {
+                    asio::buffer(nPrefix, sizeof(nPrefix)),
+                    asio::buffer(pHeader, pHeader ? sizeof(message_header<T>) : 0),
+                    asio::buffer(pBody, pHeader ? pHeader->size : 0)
+                };
+
+                asio::ip::udp::endpoint remote;
+                {
+                    std::scoped_lock lock(m_muxUdp);
+                    remote = m_udpRemote;
+                }
+                return m_pUdp->SendTo(buffers, remote);
+            }
+
+            // Client - Bring up the unreliable channel once the handshake has agreed on it. The server
+            // is reached at its TCP address and port, and is told the client's address by hellos
+            void StartUnreliable()
+            {
+                asio::error_code ec;
+                asio::ip::tcp::endpoint server = m_socket.remote_endpoint(ec);
+                if (ec) return;
+
+                m_nDatagramToken = m_nHandshakeOut;
+                m_pUdp->Bind(m_nDatagramToken, this);
+                {
+                    std::scoped_lock lock(m_muxUdp);
+                    m_udpRemote = asio::ip::udp::endpoint(server.address(), server.port());
+                }
+                m_bUdpReady = true;
+
+                SendHello(0);
+            }
+
+            // Client - Say hello until the server answers, giving up after a few tries. The server
+            // then keeps sending over TCP until some other datagram from the client reaches it
+            void SendHello(size_t nAttempt)
+            {
+                if (m_bHelloAcked || nAttempt == nHelloAttempts || !IsConnected()) return;
+
+                SendDatagram(nullptr, nullptr);
+
+                m_timerHello.expires_after(std::chrono::milliseconds(200));
+                m_timerHello.async_wait(bind_handler_memory(m_handlerMemory, [this, nAttempt](std::error_code ec)
+                    {
+                        if (!ec) SendHello(nAttempt + 1);
+                    }));
+            }
+
+            // Callback engine - Retire the frames of a finished write and start the next one
+            void OnMessagesWritten(std::error_code ec)
+            {
+                if (RetireMessages(!ec) && !IsOutgoingEmpty()) WriteMessages();
+            }
+
+            // Take the frames of a finished write off the queue
+            // Returns false, closing the connection, if the write failed
+            bool RetireMessages(bool bWritten)
+            {
+                if (bWritten) {
+                    m_nMessagesWritten += m_nMessagesInFlight;
+                    m_nQueuedBytes -= m_nBytesInFlight;
+                    m_nQueuedCount -= m_nMessagesInFlight;
+                    if (m_bCongested && IsBelowLowWater()) m_bCongested = false;
+
+                    for (size_t n = 0; n < nLaneCount; n++) {
+                        std::deque<outgoing_message> &lane = m_qMessagesOut[n];
+                        if (!m_mapLatest.empty()) {
+                            for (size_t i = 0; i < m_nLaneInFlight[n]; i++) ForgetLatest(lane[i]);
+                        }
+                        lane.erase(lane.begin(), lane.begin() + m_nLaneInFlight[n]);
+                        m_nLaneInFlight[n] = 0;
+                    }
+                    m_nMessagesInFlight = 0;
+                    m_outFile = outgoing_message();
+                    return true;
+                } else {
+                    std::cout << "[" << id << "] Write Fail.\n";
+                    m_socket.close();
+                    return false;
+                }
+            }
+
+            // Gather the header of a file frame on its own, its body is then sent straight from the file
+            // The entry is copied, as dropping messages may move the queue around it meanwhile
+            void GatherFileFrame(const outgoing_message &out)
+            {
+                m_outFile = out;
+
+                message_header<T> header = out.msg->header;
+                header.size = out.nLength;
+                header.flags = FrameFlags(out);
+                m_vChunkHeaders.push_back(header);
+                m_vWriteBuffers.push_back(asio::buffer(&m_vChunkHeaders.back(), sizeof(message_header<T>)));
+            }
+
+            // Callback engine - Send the body of the file frame in m_outFile from nDone bytes onwards
+            void WriteFileBody(size_t nDone)
+            {
+#if defined(__linux__)
+                if (!SendFileBody(nDone)) {
+                    OnMessagesWritten(std::make_error_code(std::errc::io_error));
+                } else if (nDone < m_outFile.nLength) {
+                    // Socket buffer is full, carry on once it drains
+                    m_socket.async_wait(asio::ip::tcp::socket::wait_write,
+                        bind_handler_memory(m_handlerMemory, [this, nDone](std::error_code ec)
+                        {
+                            if (!ec) WriteFileBody(nDone);
+                            else OnMessagesWritten(ec);
+                        }));
+                } else {
+                    OnMessagesWritten({});
+                }
+#else
+                if (nDone == m_outFile.nLength) {
+                    OnMessagesWritten({});
+                    return;
+                }
+
+                size_t nPiece = 0;
+                if (!ReadFilePiece(nDone, nPiece)) {
+                    OnMessagesWritten(std::make_error_code(std::errc::io_error));
+                    return;
+                }
+
+                asio::async_write(m_socket, asio::buffer(m_vFileBuffer.data(), nPiece),
+                    bind_handler_memory(m_handlerMemory, [this, nDone, nPiece](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec) WriteFileBody(nDone + nPiece);
+                        else OnMessagesWritten(ec);
+                    }));
+#endif
+            }
+
+#if defined(__linux__)
+            // Have the kernel copy the file frame body from the page cache to the socket, from nDone
+            // bytes onwards, until it is all sent or the socket's send buffer is full. The socket is
+            // non-blocking, so a full buffer never stalls the thread. Returns false on an error, or if
+            // the file is shorter than it was when it was queued
+            bool SendFileBody(size_t &nDone)
+            {
+                const size_t nLength = m_outFile.nLength;
+                const uint64_t nStart = uint64_t(m_outFile.nOffset);
+
+                m_socket.native_non_blocking(true);
+                int nFile = fileno(m_outFile.file->pFile);
+
+                while (nDone < nLength) {
+                    off_t nPos = off_t(nStart + nDone);
+                    ssize_t nSent = ::sendfile(m_socket.native_handle(), nFile, &nPos, nLength - nDone);
+
+                    if (nSent > 0) {
+                        nDone += size_t(nSent);
+                    } else if (nSent < 0 && errno == EINTR) {
+                        continue;
+                    } else if (nSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return true;
+                    } else {
+                        std::cout << "[" << id << "] Send File Fail.\n";
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+#else
+            // Without sendfile() the file frame body is read a piece at a time into a small buffer
+            // Returns false if the piece starting nDone bytes in cannot be read
+            bool ReadFilePiece(size_t nDone, size_t &nPiece)
+            {
+                nPiece = std::min(m_outFile.nLength - nDone, m_vFileBuffer.size());
+                if (!m_outFile.file->seek(uint64_t(m_outFile.nOffset) + nDone) ||
+                    std::fread(m_vFileBuffer.data(), 1, nPiece, m_outFile.file->pFile) != nPiece) {
+                    std::cout << "[" << id << "] Send File Fail.\n";
+                    return false;
+                }
+                return true;
+            }
+#endif
+
+            // Async - Prime context to read whatever the socket has available
+            // Bytes land behind any partial frame left over from the previous read, and every
+            // complete frame in the buffer is then handled in one go, so a burst of small
+            // messages costs a single read and a single completion handler
+            void ReadFrames()
+            {
+                m_socket.async_read_some(asio::buffer(m_vReadBuffer.data() + m_nReadBytes, m_vReadBuffer.size() - m_nReadBytes),
+                    bind_handler_memory(m_handlerMemory, [this](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec) {
+                            m_nReadCount++;
+                            m_nReadBytes += length;
+                            ContinueReading(ParseFrames());
+                        } else {
+                            std::cout << "[" << id << "] Read Fail.\n";
+                            m_socket.close();
+                        }
+                    }));
+            }
+
+            // Pull every complete frame out of the receive buffer and keep the partial one
+            // Returns what to read next, m_nReadOffset being how much of that has already arrived
+            read_step ParseFrames()
+            {
+                size_t nOffset = 0;
+
+                for (;;) {
+                    size_t nAvailable = m_nReadBytes - nOffset;
+
+                    // Streaming a large body: hand it on a piece at a time as the bytes come in
+                    if (m_nStreamRemaining > 0) {
+                        size_t nPiece = std::min(m_nStreamRemaining, StreamPieceSize());
+                        if (nAvailable < nPiece) break;
+
+                        AddStreamPiece(m_vReadBuffer.data() + nOffset, nPiece);
+                        nOffset += nPiece;
+                        continue;
+                    }
+
+                    if (nAvailable < sizeof(message_header<T>)) break;
+
+                    std::memcpy(&m_msgTemporaryIn.header, m_vReadBuffer.data() + nOffset, sizeof(message_header<T>));
+                    const uint8_t *pBody = m_vReadBuffer.data() + nOffset + sizeof(message_header<T>);
+                    size_t nBuffered = nAvailable - sizeof(message_header<T>);
+
+                    if (m_msgTemporaryIn.header.flags & frame_flags::transport) {
+                        if (!IsSharedMemoryMarker(m_msgTemporaryIn.header)) {
+                            std::cout << "[" << id << "] Bad Transport Frame\n";
+                            m_socket.close();
+                            return read_step::stop;
+                        }
+
+                        nOffset += sizeof(message_header<T>);
+                        OnSharedMemoryMarker();
+                        continue;
+                    }
+
+#ifdef KIM_NET_HAS_MMAP
+                    // File bodies go straight to disk when a directory has been given for them
+                    if ((m_msgTemporaryIn.header.flags & frame_flags::file) && !m_strFileDirectory.empty()) {
+                        if (!BeginFileFrame()) return read_step::stop;
+
+                        size_t nTake = std::min(nBuffered, size_t(m_msgTemporaryIn.header.size));
+                        if (nTake > 0) std::memcpy(m_pFileFrame, pBody, nTake);
+
+                        if (nTake < m_msgTemporaryIn.header.size) {
+                            // Everything buffered belongs to this frame, read the rest into the mapping
+                            m_nReadBytes = 0;
+                            m_nReadOffset = nTake;
+                            return read_step::file_frame;
+                        }
+
+                        nOffset += sizeof(message_header<T>) + m_msgTemporaryIn.header.size;
+                        EndFileFrame();
+                        continue;
+                    }
+#endif
+
+                    // A streamed body is never held whole, so it is not bound by the maximum frame size
+                    // Compressed bodies can only be inflated whole, so they are never streamed
+                    if (m_nStreamPieceSize > 0 && m_msgTemporaryIn.header.size > StreamPieceSize() &&
+                        !(m_msgTemporaryIn.header.flags & frame_flags::compressed)) {
+                        m_hdrStream = m_msgTemporaryIn.header;
+                        m_nStreamRemaining = m_hdrStream.size;
+                        nOffset += sizeof(message_header<T>);
+                        continue;
+                    }
+
+                    // Refuse a body that would be held whole before anything is allocated for it
+                    if (m_nMaxFrameSize > 0 && m_msgTemporaryIn.header.size > m_nMaxFrameSize) {
+                        std::cout << "[" << id << "] Frame Too Large (" << m_msgTemporaryIn.header.size << " bytes)\n";
+                        m_socket.close();
+                        return read_step::stop;
+                    }
+
+                    if (nBuffered < m_msgTemporaryIn.header.size) {
+                        // Body has not fully arrived. If it could never fit in the receive buffer,
+                        // read the rest of it straight into the message instead of growing the buffer
+                        if (sizeof(message_header<T>) + m_msgTemporaryIn.header.size > m_vReadBuffer.size()) {
+                            m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
+                            std::memcpy(m_msgTemporaryIn.body.data(), pBody, nBuffered);
+                            m_nReadBytes = 0;
+                            m_nReadOffset = nBuffered;
+                            return read_step::body;
+                        }
+                        break;
+                    }
+
+                    // Delivering a frame may swap a different message in, so take the frame size first
+                    uint32_t nFrameSize = m_msgTemporaryIn.header.size;
+                    if (!DeliverFrame(pBody, nFrameSize)) return read_step::stop;
+
+                    nOffset += sizeof(message_header<T>) + nFrameSize;
+                }
+
+                // Carry the partial frame over to the front of the buffer for the next read
+                if (nOffset > 0) {
+                    std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + nOffset, m_nReadBytes - nOffset);
+                    m_nReadBytes -= nOffset;
+                }
+
+                return read_step::frames;
+            }
+
+            // Callback engine - Issue the read ParseFrames() asked for
+            void ContinueReading(read_step step)
+            {
+                switch (step) {
+                    case read_step::frames:
+                        ReadFrames();
+                        break;
+                    case read_step::body:
+                        ReadBody(m_nReadOffset);
+                        break;
+#ifdef KIM_NET_HAS_MMAP
+                    case read_step::file_frame:
+                        ReadFileFrame(m_nReadOffset);
+                        break;
+#endif
+                    default:
+                        break;
+                }
+            }
 
-            connection(owner parent, asio::io_context &asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>> &qIn)
-                : m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn)
+            // Largest piece a streamed body is delivered in, never more than the receive buffer holds
+            size_t StreamPieceSize() const
             {
-                m_nOwnerType = parent;
+                return std::min(m_nStreamPieceSize, m_vReadBuffer.size());
+            }
 
-                // Construct validation check data
-                if (m_nOwnerType == owner::server) {
-                    // Connection is Server -> Client so construct random data for the 
-                    m_nHandshakeOut = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+            // Queue the next piece of a streamed body. Pieces of a chunk keep describing the chunked
+            // message, as other lanes may be written between its chunks, while pieces of a whole
+            // frame are flagged as such
+            void AddStreamPiece(const uint8_t *pData, size_t nBytes)
+            {
+                m_nStreamRemaining -= nBytes;
+                bool bFrameEnd = m_nStreamRemaining == 0;
 
-                    // Pre-calculate the result for checking when the client responds
-                    m_nHandshakeCheck = scramble(m_nHandshakeOut);
+                uint32_t nFlags;
+                if (m_hdrStream.flags & frame_flags::chunk) {
+                    nFlags = frame_flags::chunk | (bFrameEnd ? (m_hdrStream.flags & frame_flags::last_chunk) : 0);
                 } else {
-                    // Connection is Client -> Server
-                    m_nHandshakeIn = 0;
-                    m_nHandshakeOut = 0;
+                    nFlags = frame_flags::piece | (bFrameEnd ? frame_flags::last_piece : 0);
                 }
+
+                m_msgTemporaryIn.header.id = m_hdrStream.id;
+                m_msgTemporaryIn.header.size = uint32_t(nBytes);
+                m_msgTemporaryIn.header.flags = nFlags;
+                m_msgTemporaryIn.body.assign(pData, pData + nBytes);
+                AddToIncomingMessageQueue();
             }
-            
-            virtual ~connection()
+
+            // Async - Prime context ready to read the remainder of a message body
+            // that is too large for the receive buffer
+            void ReadBody(size_t nOffset)
             {
-            
+                asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data() + nOffset, m_msgTemporaryIn.body.size() - nOffset),
+                    bind_handler_memory(m_handlerMemory, [this](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec) {
+                            m_nReadCount++;
+                            if (!DeliverFrame(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size())) return;
+                            ReadFrames();
+                        } else {
+                            std::cout << "[" << id << "] Read Body Fail.\n";
+                            m_socket.close();
+                        }
+                    }));
             }
 
-            uint32_t GetID() const
+            // Hand on a received frame whose header is in m_msgTemporaryIn and whose body is at pData,
+            // which may be the message's own body. Compressed bodies are inflated first, chunks are
+            // collected unless streaming passes them on. Returns false if the connection was closed
+            bool DeliverFrame(const uint8_t *pData, size_t nBytes)
             {
-                return id;
+                const bool bChunk = (m_msgTemporaryIn.header.flags & frame_flags::chunk) && m_nStreamPieceSize == 0;
+
+                if (m_msgTemporaryIn.header.flags & frame_flags::compressed) {
+                    if (!Decompress(pData, nBytes)) return false;
+
+                    m_msgTemporaryIn.header.flags &= ~frame_flags::compressed;
+                    m_msgTemporaryIn.header.size = uint32_t(m_vInflated.size());
+                    if (bChunk) return AddChunk(m_vInflated.data(), m_vInflated.size());
+
+                    m_msgTemporaryIn.body.swap(m_vInflated);
+                    AddToIncomingMessageQueue();
+                    return true;
+                }
+
+                if (bChunk) return AddChunk(pData, nBytes);
+
+                if (pData != m_msgTemporaryIn.body.data()) m_msgTemporaryIn.body.assign(pData, pData + nBytes);
+                AddToIncomingMessageQueue();
+                return true;
             }
 
-            void ConnectToClient(kim::net::server_interface<T> *server, uint32_t uid = 0)
+            // Inflate a compressed body into m_vInflated. Its claimed size is checked against the
+            // maximum frame size, and against what the codec could possibly have produced from that
+            // many bytes, before anything is allocated. Returns false, closing the connection, on a bad body
+            bool Decompress(const uint8_t *pData, size_t nBytes)
             {
-                if (m_nOwnerType == owner::server) {
-                    if (m_socket.is_open()) {
-                        id = uid;
-                        // Write out the handshake data to be validated
-                        WriteValidation();
+                uint32_t nOriginal = 0;
+                bool bValid = nBytes >= sizeof(uint32_t);
+                if (bValid) {
+                    std::memcpy(&nOriginal, pData, sizeof(uint32_t));
+                    bValid = (m_nMaxFrameSize == 0 || nOriginal <= m_nMaxFrameSize) &&
+                        uint64_t(nOriginal) <= uint64_t(nBytes - sizeof(uint32_t)) * 256;
+                }
 
-                        // Wait asynchronously for the validation data
-                        ReadValidation(server);
-                    }
+                if (bValid) {
+                    m_vInflated.resize(nOriginal);
+
+                    const auto tStart = std::chrono::steady_clock::now();
+                    bValid = lz_codec::decompress(pData + sizeof(uint32_t), nBytes - sizeof(uint32_t), m_vInflated.data(), nOriginal);
+                    m_nDecompressNs += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - tStart).count());
+                }
+
+                if (!bValid) {
+                    std::cout << "[" << id << "] Bad Compressed Frame\n";
+                    m_socket.close();
+                    return false;
                 }
+
+                m_nFramesDecompressed++;
+                m_nDecompressBytesIn += nBytes;
+                m_nDecompressBytesOut += nOriginal;
+                return true;
             }
 
-            // Only called by clients
-            void ConnectToServer(const asio::ip::tcp::resolver::results_type &endpoints)
+            // Collect one piece of a split body. The message is queued once its last piece is in,
+            // looking as if it had been sent whole. Returns false, closing the connection, if the
+            // message would outgrow the maximum frame size
+            bool AddChunk(const uint8_t *pData, size_t nBytes)
             {
-                // Only clients can connect to servers
-                if (m_nOwnerType == owner::client) {
-                    // Request that ASIO attempt to connect to an endpoint
-                    asio::async_connect(m_socket, endpoints,
-                        [this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
-                        {
-                            // Send packet to be validated
-                            ReadValidation();
-                        });
+                if (m_nMaxFrameSize > 0 && m_msgChunked.body.size() + nBytes > m_nMaxFrameSize) {
+                    std::cout << "[" << id << "] Chunked Message Too Large\n";
+                    m_socket.close();
+                    return false;
                 }
+
+                m_msgChunked.body.insert(m_msgChunked.body.end(), pData, pData + nBytes);
+
+                if (m_msgTemporaryIn.header.flags & frame_flags::last_chunk) {
+                    m_msgChunked.header.id = m_msgTemporaryIn.header.id;
+                    m_msgChunked.header.size = uint32_t(m_msgChunked.body.size());
+                    m_msgChunked.header.flags = m_msgTemporaryIn.header.flags & frame_flags::file;
+                    m_msgTemporaryIn = std::move(m_msgChunked);
+                    m_msgChunked.body.clear();
+                    AddToIncomingMessageQueue();
+                }
+
+                return true;
             }
 
-            // Can be called by both clients and servers
-            void Disconnect()
+#ifdef KIM_NET_HAS_MMAP
+            // Open the file being received if this is its first frame, grow it by the frame's body
+            // and map a window over the new bytes to receive them into. Returns false, closing the
+            // connection, if any of that fails
+            bool BeginFileFrame()
+            {
+                if (m_nFileIn < 0) {
+                    m_strFileIn = m_strFileDirectory + "/" + std::to_string(id) + "_" + std::to_string(m_nFilesReceived++);
+                    m_nFileIn = ::open(m_strFileIn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                    m_nFileInSize = 0;
+                }
+
+                m_pFileFrame = nullptr;
+                size_t nSize = m_msgTemporaryIn.header.size;
+
+                if (m_nFileIn >= 0 && nSize > 0 && ::ftruncate(m_nFileIn, off_t(m_nFileInSize + nSize)) == 0) {
+                    // Mappings start on a page boundary, so the window may begin a little early
+                    uint64_t nPage = uint64_t(::sysconf(_SC_PAGESIZE));
+                    uint64_t nStart = m_nFileInSize / nPage * nPage;
+                    m_nFileMapLength = size_t(m_nFileInSize - nStart) + nSize;
+
+                    void *pMap = ::mmap(nullptr, m_nFileMapLength, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFileIn, off_t(nStart));
+                    if (pMap != MAP_FAILED) m_pFileFrame = static_cast<uint8_t *>(pMap) + (m_nFileInSize - nStart);
+                }
+
+                if (m_nFileIn < 0 || (nSize > 0 && !m_pFileFrame)) {
+                    std::cout << "[" << id << "] Receive File Fail.\n";
+                    CloseFileIn();
+                    m_socket.close();
+                    return false;
+                }
+
+                return true;
+            }
+
+            // Async - Prime context to read the rest of a file frame straight into its mapping
+            void ReadFileFrame(size_t nOffset)
             {
-                if (IsConnected()) asio::post(m_asioContext, [this]() { m_socket.close(); });
+                asio::async_read(m_socket, asio::buffer(m_pFileFrame + nOffset, m_msgTemporaryIn.header.size - nOffset),
+                    bind_handler_memory(m_handlerMemory, [this](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec) {
+                            m_nReadCount++;
+                            EndFileFrame();
+                            ReadFrames();
+                        } else {
+                            std::cout << "[" << id << "] Read File Fail.\n";
+                            CloseFileIn();
+                            m_socket.close();
+                        }
+                    }));
             }
-            // Is connection open and active
-            bool IsConnected() const
+
+            // Unmap a received file frame, and once the whole file is in, deliver its path
+            void EndFileFrame()
             {
-                return m_socket.is_open();
+                UnmapFileFrame();
+                m_nFileInSize += m_msgTemporaryIn.header.size;
+
+                const uint32_t nFlags = m_msgTemporaryIn.header.flags;
+                if (!(nFlags & frame_flags::chunk) || (nFlags & frame_flags::last_chunk)) {
+                    ::close(m_nFileIn);
+                    m_nFileIn = -1;
+
+                    m_msgTemporaryIn.header.flags = frame_flags::file;
+                    m_msgTemporaryIn.header.size = uint32_t(m_strFileIn.size());
+                    m_msgTemporaryIn.body.assign(m_strFileIn.begin(), m_strFileIn.end());
+                    AddToIncomingMessageQueue();
+                }
             }
 
-            // Prime the connection to wait for incoming messages
-            void StartListening()
+            void UnmapFileFrame()
             {
+                if (m_pFileFrame) {
+                    uint8_t *pMap = m_pFileFrame - (m_nFileMapLength - m_msgTemporaryIn.header.size);
+                    ::munmap(pMap, m_nFileMapLength);
+                    m_pFileFrame = nullptr;
+                }
+            }
+#endif
 
+            // Release a file that was being received when the connection went away
+            void CloseFileIn()
+            {
+#ifdef KIM_NET_HAS_MMAP
+                UnmapFileFrame();
+                if (m_nFileIn >= 0) ::close(m_nFileIn);
+                m_nFileIn = -1;
+#endif
             }
 
-            // Async: Send a message on a one-on-one connection with the server
-            void Send(const message<T> &msg)
+            // Start moving messages once the handshake is done. The callback engine reads on demand
+            // and writes whenever messages are queued, the coroutine engine runs a loop for each
+            void StartEngine()
             {
-                // Send a job to ASIO context whenever needed
-                asio::post(m_asioContext,
-                    [this, msg]()
-                    {
-                        // If there are outgoing messages in queue, then in the background, ASIO is sending
-                        bool bWritingMessage = !m_qMessagesOut.empty();
-                        m_qMessagesOut.push_back(msg);
-                        if (!bWritingMessage) {
-                            WriteHeader();
-                        }
-                    });
+#ifdef KIM_NET_HAS_COROUTINES
+                if (m_bCoroutines) {
+                    // A server's connection is kept alive by its loops until both have finished
+                    std::shared_ptr<connection<T>> self = this->weak_from_this().lock();
+                    asio::co_spawn(m_socket.get_executor(), ReadLoop(self), asio::detached);
+                    asio::co_spawn(m_socket.get_executor(), WriteLoop(self), asio::detached);
+                    return;
+                }
+#endif
+                ReadFrames();
             }
 
-        private: 
-            // Async - Prime context to write a message header
-            // The outgoing message queue has at least one message to write 
-            // so allocate a buffer to hold teh message and then send the bytes
-            void WriteHeader()
+            // Get messages just queued on an idle connection going. Nothing goes out before the
+            // validation packet, whatever was queued waits for it to be written
+            void StartWriting()
             {
-                asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
-                    [this](std::error_code ec, std::size_t length)
-                    {
-                        if (!ec) {
-                            if (m_qMessagesOut.front().body.size() > 0) {
-                                WriteBody();
-                            } else {
-                                m_qMessagesOut.pop_front();
+                if (!m_bValidationWritten) return;
 
-                                // Check if queue is empty
-                                if (!m_qMessagesOut.empty())
-                                {
-                                    WriteHeader();
-                                }
-                            }
-                        } else {
-                            std::cout << "[" << id << "] Write Header Fail.\n";
+#ifdef KIM_NET_HAS_COROUTINES
+                if (m_bCoroutines) {
+                    m_timerWrite.cancel();
+                    return;
+                }
+#endif
+                WriteMessages();
+            }
+
+#ifdef KIM_NET_HAS_COROUTINES
+            // Coroutine engine - Read and parse frames until the connection closes. Each read suspends
+            // the one coroutine frame instead of allocating a completion handler for the next step
+            asio::awaitable<void> ReadLoop(std::shared_ptr<connection<T>> self)
+            {
+                // Never read: holding self in the coroutine frame keeps the connection alive while it runs
+                (void)self;
+
+                read_step step = read_step::frames;
+
+                while (step != read_step::stop) {
+                    asio::error_code ec;
+
+                    if (step == read_step::frames) {
+                        size_t length = co_await m_socket.async_read_some(
+                            asio::buffer(m_vReadBuffer.data() + m_nReadBytes, m_vReadBuffer.size() - m_nReadBytes),
+                            asio::redirect_error(asio::use_awaitable, ec));
+                        if (ec) {
+                            std::cout << "[" << id << "] Read Fail.\n";
                             m_socket.close();
+                            break;
                         }
-                    });
+
+                        m_nReadCount++;
+                        m_nReadBytes += length;
+                        step = ParseFrames();
+                    } else if (step == read_step::body) {
+                        co_await asio::async_read(m_socket,
+                            asio::buffer(m_msgTemporaryIn.body.data() + m_nReadOffset, m_msgTemporaryIn.body.size() - m_nReadOffset),
+                            asio::redirect_error(asio::use_awaitable, ec));
+                        if (ec) {
+                            std::cout << "[" << id << "] Read Body Fail.\n";
+                            m_socket.close();
+                            break;
+                        }
+
+                        m_nReadCount++;
+                        step = DeliverFrame(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()) ? read_step::frames : read_step::stop;
+                    } else {
+#ifdef KIM_NET_HAS_MMAP
+                        co_await asio::async_read(m_socket,
+                            asio::buffer(m_pFileFrame + m_nReadOffset, m_msgTemporaryIn.header.size - m_nReadOffset),
+                            asio::redirect_error(asio::use_awaitable, ec));
+                        if (ec) {
+                            std::cout << "[" << id << "] Read File Fail.\n";
+                            CloseFileIn();
+                            m_socket.close();
+                            break;
+                        }
+
+                        m_nReadCount++;
+                        EndFileFrame();
+                        step = read_step::frames;
+#else
+                        step = read_step::stop;
+#endif
+                    }
+                }
+
+                // The socket is closed, let the writer see it
+                m_timerWrite.cancel();
+            }
+
+            // Coroutine engine - Write whatever is queued, then sleep on m_timerWrite until
+            // StartWriting() or the end of the read loop wakes it
+            asio::awaitable<void> WriteLoop(std::shared_ptr<connection<T>> self)
+            {
+                // Never read: holding self in the coroutine frame keeps the connection alive while it runs
+                (void)self;
+
+                while (IsConnected()) {
+                    asio::error_code ec;
+
+                    if (IsOutgoingEmpty() || !m_bValidationWritten) {
+                        m_timerWrite.expires_at(asio::steady_timer::time_point::max());
+                        co_await m_timerWrite.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                        continue;
+                    }
+
+                    bool bFile = GatherMessages();
+                    co_await asio::async_write(m_socket, write_buffers{ m_vWriteBuffers.data(), m_vWriteBuffers.data() + m_vWriteBuffers.size() },
+                        asio::redirect_error(asio::use_awaitable, ec));
+
+                    bool bWritten = !ec;
+                    if (bWritten && bFile) bWritten = co_await WriteFileBodyLoop();
+                    if (!RetireMessages(bWritten)) break;
+                }
+            }
+
+            // Coroutine engine - Send the body of the file frame in m_outFile
+            asio::awaitable<bool> WriteFileBodyLoop()
+            {
+                asio::error_code ec;
+#if defined(__linux__)
+                size_t nDone = 0;
+                while (SendFileBody(nDone)) {
+                    if (nDone == m_outFile.nLength) co_return true;
+
+                    co_await m_socket.async_wait(asio::ip::tcp::socket::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+                    if (ec) break;
+                }
+#else
+                for (size_t nDone = 0, nPiece = 0; ReadFilePiece(nDone, nPiece); nDone += nPiece) {
+                    co_await asio::async_write(m_socket, asio::buffer(m_vFileBuffer.data(), nPiece), asio::redirect_error(asio::use_awaitable, ec));
+                    if (ec) break;
+                    if (nDone + nPiece == m_outFile.nLength) co_return true;
+                }
+#endif
+                co_return false;
+            }
+#endif
+
+            // Offer the shared memory transport if it was enabled and the remote is on this host
+            void OfferSharedMemory()
+            {
+#ifdef KIM_NET_HAS_SHM
+                asio::error_code ec;
+                asio::ip::tcp::endpoint remote = m_socket.remote_endpoint(ec);
+                if (m_nShmRingSize > 0 && !ec && remote.address().is_loopback()) {
+                    m_nCapsOut |= connection_caps::shared_memory;
+                }
+#endif
+            }
+
+            // Both sides name the segment after the solved handshake value
+            std::string SharedMemoryName() const
+            {
+                uint64_t nSolved = m_nOwnerType == owner::server ? m_nHandshakeCheck : m_nHandshakeOut;
+                return "/kim_net_" + std::to_string(nSolved);
+            }
+
+            // Client - Create the segment before answering the handshake. If that fails the offer
+            // is taken back, so the server sees it was never made
+            void CreateSharedMemory()
+            {
+#ifdef KIM_NET_HAS_SHM
+                if (!m_shm.create(SharedMemoryName(), m_nShmRingSize)) {
+                    m_nCapsOut &= ~connection_caps::shared_memory;
+                    m_nCaps &= ~connection_caps::shared_memory;
+                }
+#endif
+            }
+
+            // Server - Map the segment the client created and switch over to it. If it cannot be
+            // opened, e.g. the peers are in different containers, both sides stay on TCP
+            void AttachSharedMemory()
+            {
+#ifdef KIM_NET_HAS_SHM
+                if (m_shm.open(SharedMemoryName())) {
+                    SwitchToSharedMemory();
+                } else {
+                    std::cout << "[" << id << "] Shared Memory Unavailable\n";
+                }
+#endif
             }
 
-            // Async - Prime context to write a message body
-            // A header has been sent and that header indicated a body was needed
-            // Fill a transmission buffer with the data and send it
-            void WriteBody()
+            // Queue a marker as the last frame sent over TCP and send everything after it through the
+            // ring. The marker is posted and m_bShmOut set in one step under m_muxShmSwitch, which
+            // Queue() holds while it decides, so every message posted to the strand over TCP is
+            // posted ahead of the marker and none can follow it. The bulk lane puts the marker
+            // behind everything queued
+            void SwitchToSharedMemory()
             {
-                asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-                    [this](std::error_code ec, std::size_t length)
+#ifdef KIM_NET_HAS_SHM
+                if (!StartSharedMemoryThread(m_thrShmWriter, &connection::WriteSharedMemory)) return;
+
+                std::scoped_lock lock(m_muxShmSwitch);
+#endif
+
+                asio::post(m_socket.get_executor(), [this]()
                     {
-                        if (!ec) {
-                            m_qMessagesOut.pop_front();
+                        message<T> msg;
+                        msg.header.flags = frame_flags::transport;
 
-                            // Check if queue is empty
-                            if (!m_qMessagesOut.empty()) {
-                                WriteHeader();
-                            }
-                        } else {
-                            std::cout << "[" << id << "] Write Body Fail.\n";
-                            m_socket.close();
-                        }
+                        outgoing_message out;
+                        out.msg = make_shared_message(std::move(msg));
+                        out.nFlags = frame_flags::transport;
+                        out.nSequence = m_nNextSequence++;
+
+                        bool bWritingMessage = !IsOutgoingEmpty();
+                        m_nQueuedBytes += sizeof(message_header<T>);
+                        m_nQueuedCount++;
+                        m_qMessagesOut[size_t(message_priority::bulk)].push_back(std::move(out));
+                        if (!bWritingMessage) StartWriting();
                     });
+
+                m_bShmOut = true;
+            }
+
+            // The remote has sent its last frame over TCP, everything after it comes through the ring.
+            // For the client the server's marker also says the segment is mapped on both sides
+            void OnSharedMemoryMarker()
+            {
+#ifdef KIM_NET_HAS_SHM
+                if (!m_shm.is_open() || m_thrShmReader.joinable()) return;
+                if (!StartSharedMemoryThread(m_thrShmReader, &connection::ReadSharedMemory)) return;
+
+                if (m_nOwnerType == owner::client) {
+                    m_shm.unlink();
+                    SwitchToSharedMemory();
+                }
+#endif
+            }
+
+            // Only the marker carries frame_flags::transport, and it has no id and no body. It is
+            // only sent once both sides have offered shared memory
+            bool IsSharedMemoryMarker(const message_header<T> &header) const
+            {
+                return header.flags == frame_flags::transport && header.id == T{} && header.size == 0 &&
+                    (m_nCaps & connection_caps::shared_memory);
             }
 
-            // Async - Prime context ready to read a message header (Client has sent a message)
-            // ASIO waits until it receives enough bytes to create a header of a message
-            // Construct a temporary message object to hold the message header
-            void ReadHeader()
+#ifdef KIM_NET_HAS_SHM
+            // Run one of the shared memory threads. A server side connection is shared, and the thread
+            // holds on to it until it is done, so the connection is never torn down on the thread
+            // itself: the reference is let go on the strand, or here if StopSharedMemory() is waiting
+            // for the thread, as its caller holds the connection too. Returns false if the
+            // connection is already going
+            bool StartSharedMemoryThread(std::thread &thread, void (connection::*pfnRun)())
             {
-                asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
-                    [this](std::error_code ec, std::size_t length)
+                std::shared_ptr<connection<T>> self;
+                if (m_nOwnerType == owner::server) {
+                    self = this->weak_from_this().lock();
+                    if (!self) return false;
+                }
+
+                thread = std::thread([this, self = std::move(self), pfnRun]() mutable
                     {
-                        if (!ec) {
-                            // Complete message header has been read
-                            if (m_msgTemporaryIn.header.size > 0) {
-                                // Message has body
-                                m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-                                ReadBody();
-                            } else {
-                                AddToIncomingMessageQueue();
-                            }
-                        } else {
-                            std::cout << "[" << id << "] Read Header Fail.\n";
-                            m_socket.close();
-                        }
+                        (this->*pfnRun)();
+
+                        std::scoped_lock lock(m_muxShmThreads);
+                        if (self && !m_bShmJoining) asio::post(m_socket.get_executor(), [self = std::move(self)]() {});
+                        self.reset();
                     });
+                return true;
+            }
+
+            // Put a message, already counted in the outgoing queue, in line for the writer thread
+            // Under drop_oldest the front of the line makes room for it
+            void QueueSharedMemory(outgoing_message out, size_t nBytes)
+            {
+                out.nLength = uint32_t(nBytes - sizeof(message_header<T>));
+
+                {
+                    std::scoped_lock lock(m_muxShmOut);
+                    m_deqShmOut.push_back(std::move(out));
+
+                    if (m_limits.policy == overflow_policy::drop_oldest) {
+                        while (IsAboveHighWater(0, 0) && m_deqShmOut.size() > 1) {
+                            m_nQueuedBytes -= FrameSize(m_deqShmOut.front());
+                            m_nQueuedCount--;
+                            m_nDroppedCount++;
+                            m_deqShmOut.pop_front();
+                        }
+                    }
+                }
+
+                m_cvShmOut.notify_one();
             }
 
-            // Async - Prime context ready to read a message body
-            // Header requested body and the space for a body has already been allocated
-            // int a temporary message object
-            void ReadBody()
+            // Writer thread - Copy queued messages into the outgoing ring until the connection closes.
+            // Only this thread waits for room in the ring, never a sender or the thread reading the
+            // other ring. A frame left half written would corrupt the ring, so a failure closes the connection
+            void WriteSharedMemory()
             {
-                asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-                    [this](std::error_code ec, std::size_t length)
+                auto keepWaiting = [this]() { return IsConnected() && !m_bShmStop; };
+                shm_ring ring = m_shm.ring(m_nOwnerType == owner::client ? 0 : 1);
+                std::vector<uint8_t> vBuffer;
+
+                for (;;) {
+                    outgoing_message out;
                     {
-                        if (!ec) {
-                            AddToIncomingMessageQueue();
-                        } else {
-                            std::cout << "[" << id << "] Read Body Fail.\n";
-                            m_socket.close();
+                        std::unique_lock<std::mutex> lock(m_muxShmOut);
+                        while (m_deqShmOut.empty()) {
+                            if (!keepWaiting()) return;
+                            m_cvShmOut.wait_for(lock, std::chrono::milliseconds(50));
                         }
-                    });
+                        out = std::move(m_deqShmOut.front());
+                        m_deqShmOut.pop_front();
+                    }
+
+                    // File bodies arrive in memory, so nothing is flagged
+                    message_header<T> header = out.msg->header;
+                    header.size = out.nLength;
+                    header.flags = 0;
+                    bool bWritten = ring.write(&header, sizeof(message_header<T>), keepWaiting);
+
+                    if (!out.file) {
+                        bWritten = bWritten && ring.write(out.msg->body.data(), header.size, keepWaiting);
+                    } else {
+                        // File bodies pass through a small buffer and are delivered in memory
+                        vBuffer.resize(64 * 1024);
+                        bWritten = bWritten && out.file->seek(0);
+                        for (uint64_t nDone = 0; bWritten && nDone < header.size;) {
+                            size_t nPiece = size_t(std::min<uint64_t>(header.size - nDone, vBuffer.size()));
+                            bWritten = std::fread(vBuffer.data(), 1, nPiece, out.file->pFile) == nPiece &&
+                                ring.write(vBuffer.data(), nPiece, keepWaiting);
+                            nDone += nPiece;
+                        }
+                    }
+
+                    if (!bWritten) {
+                        Disconnect();
+                        return;
+                    }
+
+                    m_nQueuedBytes -= FrameSize(out);
+                    m_nQueuedCount--;
+                    m_nMessagesWritten++;
+                    if (m_bCongested && IsBelowLowWater()) m_bCongested = false;
+                }
+            }
+
+            // Reader thread - Deliver messages from the incoming ring until the connection closes
+            void ReadSharedMemory()
+            {
+                auto keepWaiting = [this]() { return IsConnected() && !m_bShmStop; };
+                shm_ring ring = m_shm.ring(m_nOwnerType == owner::client ? 1 : 0);
+
+                for (;;) {
+                    message<T> msg;
+                    if (!ring.read(&msg.header, sizeof(message_header<T>), keepWaiting)) break;
+
+                    if (m_nMaxFrameSize > 0 && msg.header.size > m_nMaxFrameSize) {
+                        std::cout << "[" << id << "] Frame Too Large (" << msg.header.size << " bytes)\n";
+                        Disconnect();
+                        break;
+                    }
+
+                    msg.body.resize(msg.header.size);
+                    if (!ring.read(msg.body.data(), msg.body.size(), keepWaiting)) break;
+
+                    m_nMessagesRead++;
+                    if (!DeliverMessage(msg)) return;
+                }
+
+                // The ring only gives up early when the connection is closing, or when the
+                // remote has left it in a state it could not have reached
+                if (keepWaiting()) {
+                    std::cout << "[" << id << "] Bad Shared Memory Ring\n";
+                    Disconnect();
+                }
             }
+#endif
 
             // Add a full message to the queue, once it arrives
             void AddToIncomingMessageQueue()
             {
-                if (m_nOwnerType == owner::server) m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
-                else m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
+                m_nMessagesRead++;
+                DeliverMessage(m_msgTemporaryIn);
+            }
+
+            // Pass a received message to the message handler, or move it into the queue. A server
+            // side message carries its connection, which may already be on its way out, in which
+            // case the message goes with it and false is returned
+            bool DeliverMessage(message<T> &msg)
+            {
+                std::shared_ptr<connection<T>> self;
+                if (m_nOwnerType == owner::server) {
+                    self = this->weak_from_this().lock();
+                    if (!self) return false;
+                }
+
+                if (m_fnMessageHandler) {
+                    m_fnMessageHandler(std::move(self), msg);
+                    return true;
+                }
 
-                // Wait for next message
-                ReadHeader();
+#ifdef KIM_NET_MPSC_INCOMING
+                // A full ring waits for the consumer, but not past the point where Stop() joins
+                // this thread, since nobody drains the queue after that
+                if (!m_qMessagesIn.push_back({ std::move(self), std::move(msg) },
+                        [this]() { return m_asioContext.stopped() || m_bShmStop; })) {
+                    std::cout << "[" << id << "] Incoming Queue Full, Message Dropped.\n";
+                    return false;
+                }
+#else
+                m_qMessagesIn.push_back({ std::move(self), std::move(msg) });
+#endif
+                return true;
             }
 
             // Encrypt data - will need to change later on because this is a form of security through obscurity
@@ -222,33 +1952,54 @@ namespace kim
             }
 
             // Async - Used by both the client and server to write validation packet
+            // The packet also carries the features this side offers
             void WriteValidation()
             {
-                asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-                    [this](std::error_code ec, std::size_t length)
+                std::array<asio::const_buffer, 2> buffers = {
+                    asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
+                    asio::buffer(&m_nCapsOut, sizeof(uint64_t))
+                };
+
+                asio::async_write(m_socket, buffers,
+                    bind_handler_memory(m_handlerMemory, [this](std::error_code ec, std::size_t length)
                     {
                         // Validation data sent, client should wait
                         if (!ec) {
-                            if (m_nOwnerType == owner::client) ReadHeader();
+                            m_bValidationWritten = true;
+                            if (m_nOwnerType == owner::client) StartEngine();
+
+                            // Send what was queued while the handshake was going out
+                            if (!IsOutgoingEmpty()) StartWriting();
                         } else {
                             m_socket.close();
                         }
-                    });
+                    }));
             }
 
             void ReadValidation(kim::net::server_interface<T> *server = nullptr)
             {
-                asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-                    [this, server](std::error_code ec, std::size_t length)
+                std::array<asio::mutable_buffer, 2> buffers = {
+                    asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
+                    asio::buffer(&m_nCapsIn, sizeof(uint64_t))
+                };
+
+                asio::async_read(m_socket, buffers,
+                    bind_handler_memory(m_handlerMemory, [this, server](std::error_code ec, std::size_t length)
                     {
                         if (!ec) {
+                            // Both sides end up with the same set of features: the client learns the
+                            // server's before it answers, the server the client's with the answer
+                            m_nCaps = m_nCapsOut & m_nCapsIn;
+
                             if (m_nOwnerType == owner::server) {
                                 if (m_nHandshakeIn == m_nHandshakeCheck) {
+                                    if (m_nCaps & connection_caps::shared_memory) AttachSharedMemory();
+
                                     // Connect properly
                                     std::cout << "Client Validated" << std::endl;
                                     server->OnClientValidated(this->shared_from_this());
 
-                                    ReadHeader();
+                                    StartEngine();
                                 } else {
                                     std::cout << "Client Disconnected (Failed Validation)" << std::endl;
                                     m_socket.close();
@@ -256,6 +2007,8 @@ namespace kim
                             } else {
                                 // Connection is a client, so solve the puzzle
                                 m_nHandshakeOut = scramble(m_nHandshakeIn);
+                                if (m_nCaps & connection_caps::unreliable) StartUnreliable();
+                                if (m_nCaps & connection_caps::shared_memory) CreateSharedMemory();
 
                                 WriteValidation();
                             }
@@ -263,7 +2016,7 @@ namespace kim
                             std::cout << "Client Disconnected (ReadValidation)" << std::endl;
                             m_socket.close();
                         }
-                    });
+                    }));
             }
 
         protected:
@@ -273,26 +2026,187 @@ namespace kim
             // This context is shared with the whole ASIO instance
             asio::io_context &m_asioContext;
 
-            // This queue holds all messages to be sent to the 
-            // remote side of this connection
-            tsqueue<message<T>> m_qMessagesOut;
+            // These queues hold all messages to be sent to the
+            // remote side of this connection, one lane per message_priority.
+            // They are only touched on the connection's strand, so they need no lock of their own
+            std::array<std::deque<outgoing_message>, nLaneCount> m_qMessagesOut;
+
+            // Bulk bodies above this size are split into chunks, 0 to never split
+            std::atomic<size_t> m_nChunkSize{ 0 };
+
+            // Sequence number of the next queued message, and the sequence number
+            // of the pending message for every key sent with SendLatest
+            uint64_t m_nNextSequence = 0;
+            std::unordered_map<uint64_t, uint64_t> m_mapLatest;
+
+            // Upper bounds on how much a single gathered write may carry
+            static constexpr size_t nWriteBudget = 64 * 1024;
+            static constexpr size_t nMaxWriteBuffers = 64;
+
+            // Buffer sequence of the write in flight, headers made up for its chunks,
+            // and how many frames it covers in total and from each lane
+            std::vector<asio::const_buffer> m_vWriteBuffers;
+            std::vector<message_header<T>> m_vChunkHeaders;
+            size_t m_nMessagesInFlight = 0;
+            std::array<size_t, nLaneCount> m_nLaneInFlight{};
+            // Queued bytes the write in flight retires, as counted before any compression
+            size_t m_nBytesInFlight = 0;
+
+            // Compressed bodies of the write in flight. The buffers are kept for reuse
+            std::vector<std::vector<uint8_t>> m_vCompressed;
+            size_t m_nCompressedInFlight = 0;
+            // Smallest body worth compressing, see EnableCompression()
+            size_t m_nCompressThreshold = 1024;
+
+            // Outgoing queue bounds and occupancy. Counters are updated by senders on any thread,
+            // which check them against the watermarks under m_muxQueued
+            outbound_limits m_limits;
+            std::mutex m_muxQueued;
+            std::atomic<size_t> m_nQueuedBytes{ 0 };
+            std::atomic<size_t> m_nQueuedCount{ 0 };
+            std::atomic<bool> m_bCongested{ false };
+            std::atomic<uint64_t> m_nDroppedCount{ 0 };
+            std::atomic<uint64_t> m_nConflatedCount{ 0 };
+
+            // Write statistics
+            std::atomic<uint64_t> m_nWriteCount{ 0 };
+            std::atomic<uint64_t> m_nMessagesWritten{ 0 };
+
+            // Read statistics
+            std::atomic<uint64_t> m_nReadCount{ 0 };
+            std::atomic<uint64_t> m_nMessagesRead{ 0 };
+
+            // Compression statistics, see GetCompressionStats()
+            std::atomic<uint64_t> m_nFramesCompressed{ 0 };
+            std::atomic<uint64_t> m_nFramesUncompressible{ 0 };
+            std::atomic<uint64_t> m_nCompressBytesIn{ 0 };
+            std::atomic<uint64_t> m_nCompressBytesOut{ 0 };
+            std::atomic<uint64_t> m_nCompressNs{ 0 };
+            std::atomic<uint64_t> m_nFramesDecompressed{ 0 };
+            std::atomic<uint64_t> m_nDecompressBytesIn{ 0 };
+            std::atomic<uint64_t> m_nDecompressBytesOut{ 0 };
+            std::atomic<uint64_t> m_nDecompressNs{ 0 };
 
             // This queue holds all messages that have been received from
             // the remote side of this connection. Note it is a reference
             // as the "owner" of this connection is expected to provide a queue
-            tsqueue<owned_message<T>> &m_qMessagesIn;
+            incoming_queue<T> &m_qMessagesIn;
+
+            // Called with each received message in place of the queue, see SetMessageHandler()
+            message_handler m_fnMessageHandler;
 
             // Incoming messages are temporarily stored and assembled here, asynchronously
             message<T> m_msgTemporaryIn;
 
+            // Limit on incoming bodies, see SetMaxFrameSize()
+            size_t m_nMaxFrameSize = nDefaultMaxFrameSize;
+
+            // Piece size of streamed bodies, the header of the frame being streamed
+            // and how many of its body bytes are still to come
+            size_t m_nStreamPieceSize = 0;
+            message_header<T> m_hdrStream;
+            size_t m_nStreamRemaining = 0;
+
+            // Frame of the file being sent, copied out of the queue while it is written
+            outgoing_message m_outFile;
+#if !defined(__linux__)
+            // Without sendfile() file bodies pass through this buffer
+            std::vector<uint8_t> m_vFileBuffer = std::vector<uint8_t>(64 * 1024);
+#endif
+
+            // Where file bodies are received to, see SetFileDirectory()
+            std::string m_strFileDirectory;
+#ifdef KIM_NET_HAS_MMAP
+            // File being received, how much of it has arrived, how many files this
+            // connection has received, and the mapped window of the frame being read
+            int m_nFileIn = -1;
+            std::string m_strFileIn;
+            uint64_t m_nFileInSize = 0;
+            uint64_t m_nFilesReceived = 0;
+            uint8_t *m_pFileFrame = nullptr;
+            size_t m_nFileMapLength = 0;
+#endif
+
+            // Inflated body of the compressed frame being delivered
+            std::vector<uint8_t, pool_allocator<uint8_t>> m_vInflated;
+
+            // Body of a chunked message being put back together. Only the bulk lane is
+            // chunked, so at most one such message is in progress at a time
+            message<T> m_msgChunked;
+
+            // Bytes received from the socket that have not been parsed into messages yet
+            static constexpr size_t nReadBufferSize = 64 * 1024;
+            std::vector<uint8_t> m_vReadBuffer = std::vector<uint8_t>(nReadBufferSize);
+            size_t m_nReadBytes = 0;
+            // Bytes of the body or file frame ParseFrames() handed over that had already arrived
+            size_t m_nReadOffset = 0;
+
+            // Recycled memory for the completion handlers of the callback engine
+            handler_memory m_handlerMemory;
+
+            // Engine moving the messages, see EnableCoroutines(). The coroutine engine's writer
+            // sleeps on the timer while there is nothing to write
+            bool m_bCoroutines = false;
+            asio::steady_timer m_timerWrite;
+
             // The "owner" decides how some of the connection behaves
             owner m_nOwnerType = owner::server;
-            uint32_t id = 0; 
+            uint64_t id = 0; 
 
             // Handshake validation
             uint64_t m_nHandshakeOut = 0;
             uint64_t m_nHandshakeIn = 0;
             uint64_t m_nHandshakeCheck = 0;
+            // Set on the strand once this side's validation packet is written, see StartWriting()
+            bool m_bValidationWritten = false;
+
+            // Features this side offers, those the remote offered, and the ones both did
+            uint64_t m_nCapsOut = 0;
+            uint64_t m_nCapsIn = 0;
+            std::atomic<uint64_t> m_nCaps{ 0 };
+
+            // Unreliable channel, see SendUnreliable(). The token tells the channel which
+            // connection a datagram is for, and is the solved handshake value
+            std::shared_ptr<udp_channel<T>> m_pUdp;
+            uint64_t m_nDatagramToken = 0;
+            asio::ip::udp::endpoint m_udpRemote;
+            std::mutex m_muxUdp;
+            std::atomic<bool> m_bUdpReady{ false };
+            std::atomic<uint64_t> m_nDatagramSequence{ 0 };
+            // Sequence number of the newest datagram delivered for each message id, used on the strand
+            std::unordered_map<uint64_t, uint64_t> m_mapDatagramSequence;
+            std::atomic<uint64_t> m_nDatagramsSent{ 0 };
+            std::atomic<uint64_t> m_nDatagramsReceived{ 0 };
+            std::atomic<uint64_t> m_nStaleDatagrams{ 0 };
+
+            // Client hellos, see SendHello()
+            static constexpr size_t nHelloAttempts = 10;
+            asio::steady_timer m_timerHello;
+            std::atomic<bool> m_bHelloAcked{ false };
+
+            // Shared memory transport, see EnableSharedMemory(). Ring size offered (0 when not
+            // offered), whether sending has switched to the ring, and whether the reader should stop
+            size_t m_nShmRingSize = 0;
+            std::atomic<bool> m_bShmOut{ false };
+            std::atomic<bool> m_bShmStop{ false };
+#ifdef KIM_NET_HAS_SHM
+            shm_segment m_shm;
+            std::thread m_thrShmReader;
+            std::thread m_thrShmWriter;
+            // Set once StopSharedMemory() waits for the threads, see StartSharedMemoryThread()
+            std::mutex m_muxShmThreads;
+            bool m_bShmJoining = false;
+            // Messages waiting for the writer thread
+            std::deque<outgoing_message> m_deqShmOut;
+            std::mutex m_muxShmOut;
+            std::condition_variable m_cvShmOut;
+            // Held while a message picks a transport and while the connection switches, see Queue()
+            std::mutex m_muxShmSwitch;
+#endif
+
+            // SendLatest() keys used when SendUnreliable() falls back to TCP, kept apart
+            // from application keys by the top bit
+            static constexpr uint64_t nUnreliableKey = uint64_t(1) << 63;
         };
     }
 }
\ No newline at end of file
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_message.h"
+#include "net_waitpolicy.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Snapshot of the dispatch_pool counters
+        struct dispatch_stats
+        {
+            // Messages handed to the handler
+            uint64_t nDispatched = 0;
+            // Turns a worker took on a connection homed on another worker
+            uint64_t nStolen = 0;
+        };
+
+        // Runs a message handler on a pool of worker threads. Messages are sorted into one mailbox
+        // per connection, and each connection is homed on a worker by its ID. A mailbox with messages
+        // waiting is on its home worker's ready list, and only ever on one list or in one worker's
+        // hands at a time, so a connection's messages are handled one after the other, in arrival
+        // order, while different connections are handled in parallel. A worker takes the mailboxes
+        // at the front of its own list; one with nothing to do steals from the back of another's
+        template<typename T>
+        class dispatch_pool
+        {
+        public:
+            typedef std::function<void(std::shared_ptr<connection<T>>, message<T> &)> handler;
+
+            // Messages a worker handles from one mailbox before giving the others a turn
+            static constexpr size_t nBatchSize = 16;
+
+            dispatch_pool() = default;
+            dispatch_pool(const dispatch_pool &) = delete;
+            dispatch_pool &operator = (const dispatch_pool &) = delete;
+
+            ~dispatch_pool()
+            {
+                stop();
+            }
+
+            // Start nWorkers threads (0 uses one per hardware core) calling fnHandler, idle workers wait as policy says
+            void start(size_t nWorkers, handler fnHandler, const wait_policy &policy = wait_policy())
+            {
+                stop();
+
+                if (nWorkers == 0) nWorkers = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+                m_fnHandler = std::move(fnHandler);
+                m_waitPolicy = policy;
+                m_bStop = false;
+                m_bDiscard = false;
+
+                for (size_t i = 0; i < nWorkers; i++) m_vWorkers.push_back(std::make_unique<worker>());
+                for (size_t i = 0; i < nWorkers; i++) {
+                    m_vWorkers[i]->thread = std::thread([this, i]() { run(i); });
+                }
+            }
+
+            // Handle what has been posted so far, then join the workers
+            void stop()
+            {
+                m_bStop = true;
+                m_waiter.notify();
+
+                for (auto &w : m_vWorkers) {
+                    if (w->thread.joinable()) w->thread.join();
+                }
+                m_vWorkers.clear();
+            }
+
+            // From now on, throw away what is posted or still waiting instead of calling the handler
+            // Calls already under way are finished, and stop() still has to join the workers
+            void discard()
+            {
+                m_bDiscard = true;
+            }
+
+            // Number of workers, 0 when not started
+            size_t size() const
+            {
+                return m_vWorkers.size();
+            }
+
+            // Queue a message for the handler, behind the earlier messages of the same connection
+            // The message is dropped if no workers are running
+            void post(std::shared_ptr<connection<T>> remote, message<T> &&msg)
+            {
+                if (m_vWorkers.empty()) return;
+
+                uint64_t nID = remote ? remote->GetID() : 0;
+                worker &home = *m_vWorkers[nID % m_vWorkers.size()];
+
+                bool bReady = false;
+                {
+                    std::scoped_lock lock(home.mux);
+                    mailbox &box = home.mapMailboxes[nID];
+                    box.nID = nID;
+                    box.deqMessages.push_back({ std::move(remote), std::move(msg) });
+
+                    if (!box.bScheduled) {
+                        box.bScheduled = true;
+                        home.deqReady.push_back(&box);
+                        m_nReady.fetch_add(1, std::memory_order_relaxed);
+                        bReady = true;
+                    }
+                }
+
+                if (bReady) m_waiter.notify();
+            }
+
+            dispatch_stats stats() const
+            {
+                dispatch_stats s;
+                s.nDispatched = m_nDispatched.load(std::memory_order_relaxed);
+                s.nStolen = m_nStolen.load(std::memory_order_relaxed);
+                return s;
+            }
+
+            // How idle workers waited for messages
+            wait_stats get_wait_stats() const
+            {
+                return m_waiter.stats();
+            }
+
+        private:
+            // Messages of one connection. bScheduled is set while the mailbox is on a ready list
+            // or being worked on, so a second worker never picks it up
+            struct mailbox
+            {
+                uint64_t nID = 0;
+                bool bScheduled = false;
+                std::deque<owned_message<T>> deqMessages;
+            };
+
+            // A worker and the connections homed on it, everything but the thread guarded by mux
+            struct worker
+            {
+                std::mutex mux;
+                std::unordered_map<uint64_t, mailbox> mapMailboxes;
+                std::deque<mailbox *> deqReady;
+                std::thread thread;
+            };
+
+            void run(size_t nSelf)
+            {
+                std::vector<owned_message<T>> vBatch;
+                vBatch.reserve(nBatchSize);
+
+                for (;;) {
+                    worker *pHome = nullptr;
+                    mailbox *pBox = take(nSelf, pHome);
+
+                    if (!pBox) {
+                        if (m_bStop && m_nReady.load(std::memory_order_relaxed) == 0) return;
+                        m_waiter.wait(m_waitPolicy, [this]() { return m_nReady.load(std::memory_order_relaxed) > 0 || m_bStop; });
+                        continue;
+                    }
+
+                    {
+                        std::scoped_lock lock(pHome->mux);
+                        while (vBatch.size() < nBatchSize && !pBox->deqMessages.empty()) {
+                            vBatch.push_back(std::move(pBox->deqMessages.front()));
+                            pBox->deqMessages.pop_front();
+                        }
+                    }
+
+                    for (auto &msg : vBatch) {
+                        if (!m_bDiscard) m_fnHandler(std::move(msg.remote), msg.msg);
+                    }
+                    m_nDispatched.fetch_add(vBatch.size(), std::memory_order_relaxed);
+                    vBatch.clear();
+
+                    // Back on its home's list if more arrived, otherwise the mailbox goes
+                    bool bReady = false;
+                    {
+                        std::scoped_lock lock(pHome->mux);
+                        if (!pBox->deqMessages.empty()) {
+                            pHome->deqReady.push_back(pBox);
+                            m_nReady.fetch_add(1, std::memory_order_relaxed);
+                            bReady = true;
+                        } else {
+                            pHome->mapMailboxes.erase(pBox->nID);
+                        }
+                    }
+
+                    if (bReady) m_waiter.notify();
+                }
+            }
+
+            // Next mailbox for worker nSelf: the oldest on its own list, else the newest on another's
+            mailbox *take(size_t nSelf, worker *&pHome)
+            {
+                const size_t nWorkers = m_vWorkers.size();
+
+                for (size_t k = 0; k < nWorkers; k++) {
+                    worker &w = *m_vWorkers[(nSelf + k) % nWorkers];
+                    std::scoped_lock lock(w.mux);
+                    if (w.deqReady.empty()) continue;
+
+                    mailbox *pBox;
+                    if (k == 0) {
+                        pBox = w.deqReady.front();
+                        w.deqReady.pop_front();
+                    } else {
+                        pBox = w.deqReady.back();
+                        w.deqReady.pop_back();
+                        m_nStolen.fetch_add(1, std::memory_order_relaxed);
+                    }
+
+                    m_nReady.fetch_sub(1, std::memory_order_relaxed);
+                    pHome = &w;
+                    return pBox;
+                }
+
+                return nullptr;
+            }
+
+            handler m_fnHandler;
+            wait_policy m_waitPolicy;
+            std::vector<std::unique_ptr<worker>> m_vWorkers;
+
+            // Mailboxes on the ready lists, which is what idle workers wait for
+            std::atomic<size_t> m_nReady{ 0 };
+            std::atomic<bool> m_bStop{ false };
+            std::atomic<bool> m_bDiscard{ false };
+            queue_waiter m_waiter;
+
+            std::atomic<uint64_t> m_nDispatched{ 0 };
+            std::atomic<uint64_t> m_nStolen{ 0 };
+        };
+    }
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_bufferpool.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Snapshot of the handler_memory counters. Once a connection is running, nOverflowed
+        // should stop growing - every completion handler then lives in a recycled slot
+        struct handler_memory_stats
+        {
+            // Handlers placed in one of the slots
+            uint64_t nRecycled = 0;
+            // Handlers that were too large, or found every slot taken, and went to the buffer pool
+            uint64_t nOverflowed = 0;
+        };
+
+        // Storage for the completion handlers of one connection (or the acceptor of a server). An
+        // asynchronous operation allocates its state, which holds the handler, when it starts and
+        // frees it just before the handler runs, so only a few of them are ever alive together:
+        // a read, a write, and a timer or two. Each takes one of a handful of fixed size slots, so
+        // the steady state read/write loop never reaches the heap. The memory has to outlive every
+        // operation started with it, as the handlers using it have to outlive the object they capture
+        class handler_memory
+        {
+        public:
+            static constexpr size_t nSlotCount = 4;
+            static constexpr size_t nSlotSize = 512;
+
+            handler_memory() = default;
+            handler_memory(const handler_memory &) = delete;
+            handler_memory &operator = (const handler_memory &) = delete;
+
+            // Operations may start on any thread and finish on an I/O thread, so slots are claimed atomically
+            void *allocate(size_t nBytes)
+            {
+                if (nBytes <= nSlotSize) {
+                    for (slot &s : m_slots) {
+                        if (!s.bInUse.load(std::memory_order_relaxed) && !s.bInUse.exchange(true, std::memory_order_acquire)) {
+                            m_nRecycled.fetch_add(1, std::memory_order_relaxed);
+                            return s.data;
+                        }
+                    }
+                }
+
+                m_nOverflowed.fetch_add(1, std::memory_order_relaxed);
+                return buffer_pool::instance().allocate(nBytes);
+            }
+
+            void deallocate(void *p, size_t nBytes)
+            {
+                for (slot &s : m_slots) {
+                    if (p == s.data) {
+                        s.bInUse.store(false, std::memory_order_release);
+                        return;
+                    }
+                }
+
+                buffer_pool::instance().deallocate(p, nBytes);
+            }
+
+            handler_memory_stats stats() const
+            {
+                handler_memory_stats s;
+                s.nRecycled = m_nRecycled.load(std::memory_order_relaxed);
+                s.nOverflowed = m_nOverflowed.load(std::memory_order_relaxed);
+                return s;
+            }
+
+        private:
+            struct slot
+            {
+                alignas(std::max_align_t) unsigned char data[nSlotSize];
+                std::atomic<bool> bInUse{ false };
+            };
+
+            slot m_slots[nSlotCount];
+
+            std::atomic<uint64_t> m_nRecycled{ 0 };
+            std::atomic<uint64_t> m_nOverflowed{ 0 };
+        };
+
+        // Standard allocator drawing from a handler_memory
+        template<typename U>
+        class handler_allocator
+        {
+        public:
+            typedef U value_type;
+
+            explicit handler_allocator(handler_memory &memory) noexcept
+                : m_pMemory(&memory)
+            {
+
+            }
+
+            template<typename V>
+            handler_allocator(const handler_allocator<V> &other) noexcept
+                : m_pMemory(other.m_pMemory)
+            {
+
+            }
+
+            U *allocate(size_t n)
+            {
+                return static_cast<U *>(m_pMemory->allocate(n * sizeof(U)));
+            }
+
+            void deallocate(U *p, size_t n) noexcept
+            {
+                m_pMemory->deallocate(p, n * sizeof(U));
+            }
+
+            template<typename V>
+            bool operator == (const handler_allocator<V> &other) const noexcept { return m_pMemory == other.m_pMemory; }
+
+            template<typename V>
+            bool operator != (const handler_allocator<V> &other) const noexcept { return m_pMemory != other.m_pMemory; }
+
+        private:
+            template<typename V>
+            friend class handler_allocator;
+
+            handler_memory *m_pMemory;
+        };
+
+        // Completion handler wrapper that tells ASIO, through its associated allocator, to keep
+        // the operation's state in a handler_memory. Composed operations such as async_write
+        // pass the allocator on to each of their steps
+        template<typename Handler>
+        class memory_handler
+        {
+        public:
+            typedef handler_allocator<Handler> allocator_type;
+
+            memory_handler(handler_memory &memory, Handler handler)
+                : m_pMemory(&memory), m_handler(std::move(handler))
+            {
+
+            }
+
+            allocator_type get_allocator() const noexcept
+            {
+                return allocator_type(*m_pMemory);
+            }
+
+            template<typename... Args>
+            void operator () (Args &&...args)
+            {
+                m_handler(std::forward<Args>(args)...);
+            }
+
+        private:
+            handler_memory *m_pMemory;
+            Handler m_handler;
+        };
+
+        // Wrap a handler so the operation it completes is allocated from memory
+        template<typename Handler>
+        memory_handler<typename std::decay<Handler>::type> bind_handler_memory(handler_memory &memory, Handler &&handler)
+        {
+            return memory_handler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+        }
+    }
+}
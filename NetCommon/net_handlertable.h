@@ -0,0 +1,139 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_message.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Binds the message id Id to Handler, a member function of the class owning a message_table.
+        // The handler's parameters decide how the body is decoded:
+        //   void (std::shared_ptr<connection<T>> client)                 - body ignored
+        //   void (std::shared_ptr<connection<T>> client, message<T> &msg) - the message as it arrived
+        //   void (std::shared_ptr<connection<T>> client, const P &data)   - body is exactly one trivially copyable P
+        template<auto Id, auto Handler>
+        struct on_message
+        {
+            static constexpr auto id = Id;
+            static constexpr auto handler = Handler;
+        };
+
+        // Position of a message id in a message_table
+        template<typename T>
+        constexpr size_t message_index(T id)
+        {
+            return size_t(static_cast<typename std::underlying_type<T>::type>(id));
+        }
+
+        // Are all of the indices different
+        template<size_t nBindings>
+        constexpr bool message_indices_unique(const std::array<size_t, nBindings> &nIndices)
+        {
+            for (size_t i = 0; i < nBindings; i++) {
+                for (size_t j = i + 1; j < nBindings; j++) {
+                    if (nIndices[i] == nIndices[j]) return false;
+                }
+            }
+            return true;
+        }
+
+        // Dense table of N entries with pEntries[i] at nIndices[i], nullptr everywhere else
+        template<typename Entry, size_t N, size_t nBindings>
+        constexpr std::array<Entry, N> make_message_table(const std::array<size_t, nBindings> &nIndices, const std::array<Entry, nBindings> &pEntries)
+        {
+            std::array<Entry, N> table{};
+            for (size_t i = 0; i < nBindings; i++) table[nIndices[i]] = pEntries[i];
+            return table;
+        }
+
+        // Table of message handlers built at compile time from on_message bindings, indexed by
+        // the value of the message id. Looking up a handler is one bounds check and one indexed
+        // call through a function pointer, with no virtual call and no branching per id. Each
+        // entry is generated for its handler and decodes the payload that handler takes. Ids
+        // without a binding, and bodies that do not match the payload type, are rejected before
+        // any handler runs. Ids should be small and dense, as the table has an entry for every
+        // value up to the largest one bound
+        template<typename T, typename Owner, typename... Bindings>
+        class message_table
+        {
+        public:
+            // Largest id value a table may be built for
+            static constexpr size_t nMaxTableSize = 4096;
+
+            // Is there a handler for this id
+            static bool accepts(T id)
+            {
+                size_t n = message_index(id);
+                return n < nTableSize && table[n] != nullptr;
+            }
+
+            // Decode msg and call its handler on owner. Returns false, having called nothing,
+            // if the id has no handler or the body does not decode
+            static bool dispatch(Owner &owner, std::shared_ptr<connection<T>> client, message<T> &msg)
+            {
+                size_t n = message_index(msg.header.id);
+                if (n >= nTableSize || table[n] == nullptr) return false;
+                return table[n](owner, client, msg);
+            }
+
+        private:
+            typedef bool (*thunk)(Owner &, std::shared_ptr<connection<T>> &, message<T> &);
+
+            // Payload a handler takes, worked out from its signature
+            template<typename Handler>
+            struct handler_traits;
+
+            template<typename C>
+            struct handler_traits<void (C::*)(std::shared_ptr<connection<T>>)>
+            {
+                static constexpr bool bHasPayload = false;
+                typedef void payload;
+            };
+
+            template<typename C, typename P>
+            struct handler_traits<void (C::*)(std::shared_ptr<connection<T>>, P)>
+            {
+                static constexpr bool bHasPayload = true;
+                typedef typename std::decay<P>::type payload;
+            };
+
+            // Entry of one binding: decode the body into what the handler takes, then call it
+            template<typename Binding>
+            static bool invoke(Owner &owner, std::shared_ptr<connection<T>> &client, message<T> &msg)
+            {
+                typedef handler_traits<typename std::remove_cv<decltype(Binding::handler)>::type> traits;
+                typedef typename traits::payload payload;
+
+                if constexpr (!traits::bHasPayload) {
+                    (owner.*Binding::handler)(std::move(client));
+                } else if constexpr (std::is_same<payload, message<T>>::value) {
+                    (owner.*Binding::handler)(std::move(client), msg);
+                } else {
+                    static_assert(std::is_trivially_copyable<payload>::value, "Payload must be trivially copyable, or take the message<T> itself");
+
+                    if (msg.body.size() != sizeof(payload)) return false;
+                    payload data;
+                    std::memcpy(&data, msg.body.data(), sizeof(payload));
+                    (owner.*Binding::handler)(std::move(client), data);
+                }
+
+                return true;
+            }
+
+            static_assert(sizeof...(Bindings) > 0, "A message table needs at least one binding");
+            static_assert((std::is_same<typename std::remove_cv<decltype(Bindings::id)>::type, T>::value && ...), "Every binding's id must be of the table's message id type");
+            static_assert(((std::is_signed<typename std::underlying_type<T>::type>::value ? int64_t(Bindings::id) >= 0 : true) && ...), "Message ids must not be negative");
+
+            static constexpr std::array<size_t, sizeof...(Bindings)> nIndices = { message_index(Bindings::id)... };
+            static_assert(message_indices_unique(nIndices), "Message id bound more than once");
+
+            static constexpr size_t nTableSize = std::max({ (message_index(Bindings::id) + 1)... });
+            static_assert(nTableSize <= nMaxTableSize, "Message ids are too large for a dense table");
+
+            // Entry i holds the handler of the id whose value is i
+            static constexpr std::array<thunk, nTableSize> table = make_message_table<thunk, nTableSize>(
+                nIndices, std::array<thunk, sizeof...(Bindings)>{ &invoke<Bindings>... });
+        };
+    }
+}
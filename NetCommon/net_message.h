@@ -1,11 +1,36 @@
 #pragma once
 
 #include "net_common.h"
+#include "net_bufferpool.h"
 
 namespace kim
 {
     namespace net
     {
+        // Bits of message_header::flags, describing how a frame relates to the message it carries
+        struct frame_flags
+        {
+            // Frame carries one piece of a message body that was split up for sending
+            static constexpr uint32_t chunk = 0x1;
+            // Frame carries the last piece of a split body
+            static constexpr uint32_t last_chunk = 0x2;
+            // Set on delivery only: message is part of a single large frame handed on in pieces
+            // by a streaming connection. Pieces of one frame are never interleaved with anything
+            static constexpr uint32_t piece = 0x4;
+            // Set on delivery only: message is the last piece of its frame
+            static constexpr uint32_t last_piece = 0x8;
+            // Body is the content of a file sent with connection::SendFile. When the receiver writes
+            // such bodies to disk, the delivered message carries the file's path as its body instead
+            static constexpr uint32_t file = 0x10;
+            // Body was compressed with lz_codec and starts with its original size as a uint32_t
+            // Never seen on delivery, the connection inflates the body first
+            static constexpr uint32_t compressed = 0x20;
+            // Set on delivery only: message arrived over the unreliable channel, see connection::SendUnreliable
+            static constexpr uint32_t unreliable = 0x40;
+            // Internal: last frame sent over TCP before the sender moved to shared memory, never delivered
+            static constexpr uint32_t transport = 0x80;
+        };
+
         // Message Header is sent at start of all messages.The template allows us
         // to use "enum class" to ensure that the messages are valid at compile time
         template <typename T>
@@ -14,13 +39,16 @@ namespace kim
             T id{};
             // deliberately not using size_t due to differences on 32 and 64 bit machines
             uint32_t size = 0;
+            // frame_flags, set by the connection when it frames the message
+            uint32_t flags = 0;
         };
 
         template <typename T>
         struct message
         {
             message_header<T> header{};
-            std::vector<uint8_t> body;
+            // Body storage is recycled through the buffer pool instead of the heap
+            std::vector<uint8_t, pool_allocator<uint8_t>> body;
 
             // returns the size of the entire message packet in bytes
             size_t size() const
@@ -82,6 +110,183 @@ namespace kim
 
         };
 
+        // Reads a message body front to back with a cursor, so fields come out in the order they
+        // were written. The message is left untouched, which lets several readers share it
+        template <typename T>
+        class message_reader
+        {
+        public:
+            explicit message_reader(const message<T> &msg)
+                : m_msg(msg)
+            {
+
+            }
+
+            // Number of body bytes not read yet
+            size_t remaining() const
+            {
+                return m_msg.body.size() - m_nCursor;
+            }
+
+            // Copy the next nBytes of the body into pData
+            void read(void *pData, size_t nBytes)
+            {
+                std::memcpy(pData, advance(nBytes), nBytes);
+            }
+
+            // View of the next nBytes of the body without copying them. The view is only valid
+            // for as long as the message it was read from
+            asio::const_buffer view(size_t nBytes)
+            {
+                return asio::const_buffer(advance(nBytes), nBytes);
+            }
+
+            // Pulls any POD-like data from the message buffer
+            template<typename DataType>
+            friend message_reader<T> &operator >> (message_reader<T> &reader, DataType &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+                reader.read(&data, sizeof(DataType));
+                return reader;
+            }
+
+            // Pulls a count prefixed vector of POD-like data in a single copy
+            template<typename DataType, typename Alloc>
+            friend message_reader<T> &operator >> (message_reader<T> &reader, std::vector<DataType, Alloc> &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+                uint32_t nCount = 0;
+                reader >> nCount;
+                // The count comes from the remote, so check it before allocating for it
+                if (nCount > reader.remaining() / sizeof(DataType)) throw std::out_of_range("message_reader: count runs past the end of the message body");
+                data.resize(nCount);
+                reader.read(data.data(), nCount * sizeof(DataType));
+                return reader;
+            }
+
+            // Pulls a length prefixed string in a single copy
+            friend message_reader<T> &operator >> (message_reader<T> &reader, std::string &data)
+            {
+                uint32_t nLength = 0;
+                reader >> nLength;
+                if (nLength > reader.remaining()) throw std::out_of_range("message_reader: length runs past the end of the message body");
+                data.resize(nLength);
+                reader.read(data.data(), nLength);
+                return reader;
+            }
+
+            // Pulls a fixed size array of POD-like data in a single copy
+            template<typename DataType, size_t N>
+            friend message_reader<T> &operator >> (message_reader<T> &reader, std::array<DataType, N> &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+                reader.read(data.data(), N * sizeof(DataType));
+                return reader;
+            }
+
+        private:
+            // Move the cursor past nBytes and return where they start
+            const uint8_t *advance(size_t nBytes)
+            {
+                if (nBytes > remaining()) throw std::out_of_range("message_reader: read past the end of the message body");
+
+                const uint8_t *pData = m_msg.body.data() + m_nCursor;
+                m_nCursor += nBytes;
+                return pData;
+            }
+
+            const message<T> &m_msg;
+            size_t m_nCursor = 0;
+        };
+
+        // Appends to a message body after reserving room once. Contiguous ranges go in with a
+        // single copy and the header size is only patched when the writer is finished or destroyed
+        template <typename T>
+        class message_writer
+        {
+        public:
+            message_writer(message<T> &msg, size_t nReserve = 0)
+                : m_msg(msg)
+            {
+                m_msg.body.reserve(m_msg.body.size() + nReserve);
+            }
+
+            ~message_writer()
+            {
+                finish();
+            }
+
+            // Append nBytes from pData to the body
+            void write(const void *pData, size_t nBytes)
+            {
+                const uint8_t *pBytes = static_cast<const uint8_t *>(pData);
+                m_msg.body.insert(m_msg.body.end(), pBytes, pBytes + nBytes);
+            }
+
+            // Recalculate the message size
+            void finish()
+            {
+                m_msg.header.size = uint32_t(m_msg.body.size());
+            }
+
+            // Pushes any POD-like data in the message buffer
+            template<typename DataType>
+            friend message_writer<T> &operator << (message_writer<T> &writer, const DataType &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed into vector");
+
+                writer.write(&data, sizeof(DataType));
+                return writer;
+            }
+
+            // Pushes a vector of POD-like data with a count prefix in a single copy
+            template<typename DataType, typename Alloc>
+            friend message_writer<T> &operator << (message_writer<T> &writer, const std::vector<DataType, Alloc> &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed into vector");
+
+                writer << uint32_t(data.size());
+                writer.write(data.data(), data.size() * sizeof(DataType));
+                return writer;
+            }
+
+            // Pushes a string with a length prefix in a single copy
+            friend message_writer<T> &operator << (message_writer<T> &writer, const std::string &data)
+            {
+                writer << uint32_t(data.size());
+                writer.write(data.data(), data.size());
+                return writer;
+            }
+
+            // Pushes a fixed size array of POD-like data in a single copy
+            template<typename DataType, size_t N>
+            friend message_writer<T> &operator << (message_writer<T> &writer, const std::array<DataType, N> &data)
+            {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed into vector");
+
+                writer.write(data.data(), N * sizeof(DataType));
+                return writer;
+            }
+
+        private:
+            message<T> &m_msg;
+        };
+
+        // Reference counted, immutable message. Built once and queued on any number of
+        // connections without copying the body again
+        template <typename T>
+        using shared_message = std::shared_ptr<const message<T>>;
+
+        // Freeze a message into a shared one, with the control block drawn from the buffer pool
+        template <typename T>
+        shared_message<T> make_shared_message(message<T> msg)
+        {
+            return std::allocate_shared<message<T>>(pool_allocator<message<T>>(), std::move(msg));
+        }
+
         /* Owned messaged is identical to a reqular message but is associated with 
            a connection. On a server, the owner would be the client and on a client,
            it would be the server. */
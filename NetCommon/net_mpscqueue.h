@@ -0,0 +1,220 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_waitpolicy.h"
+
+namespace kim
+{
+    namespace net
+    {
+        template<typename T>
+        // (Lock-free, many producers, one consumer)
+        // Bounded ring buffer where each cell carries a sequence number telling producers and
+        // the consumer whose turn it is. Pushing and popping never take a lock; producers only
+        // lock to wake the consumer when it is actually asleep in wait()
+        class mpscqueue
+        {
+        public:
+            // Capacity is rounded up to a power of two
+            explicit mpscqueue(size_t nCapacity = 16384)
+            {
+                size_t nSize = 2;
+                while (nSize < nCapacity) nSize <<= 1;
+
+                m_nMask = nSize - 1;
+                m_pCells = std::make_unique<cell[]>(nSize);
+                for (size_t i = 0; i < nSize; i++) {
+                    m_pCells[i].nSequence.store(i, std::memory_order_relaxed);
+                }
+            }
+
+            // Delete the copy constructor
+            mpscqueue(const mpscqueue<T>&) = delete;
+
+            // Destructor
+            virtual ~mpscqueue() { clear(); }
+
+            // Returns item at front of queue - consumer only, queue must not be empty
+            const T& front()
+            {
+                return *m_pCells[m_nHead.value.load(std::memory_order_relaxed) & m_nMask].ptr();
+            }
+
+            // Removes and returns item from front of queue - consumer only, queue must not be empty
+            T pop_front()
+            {
+                std::optional<T> t = try_pop_front();
+                return std::move(*t);
+            }
+
+            // Removes item from front of queue if there is one - consumer only
+            std::optional<T> try_pop_front()
+            {
+                size_t nPos = m_nHead.value.load(std::memory_order_relaxed);
+                cell &c = m_pCells[nPos & m_nMask];
+
+                // The producer publishes a cell by setting its sequence one past its position
+                if (c.nSequence.load(std::memory_order_acquire) != nPos + 1) return std::nullopt;
+
+                std::optional<T> t(std::move(*c.ptr()));
+                c.ptr()->~T();
+
+                // Hand the cell back to producers for the next lap around the ring
+                c.nSequence.store(nPos + m_nMask + 1, std::memory_order_release);
+                m_nHead.value.store(nPos + 1, std::memory_order_release);
+                return t;
+            }
+
+            // Adds an item to back of queue, returns false if the queue is full
+            bool try_push_back(T &&item)
+            {
+                size_t nPos = m_nTail.value.load(std::memory_order_relaxed);
+
+                for (;;) {
+                    cell &c = m_pCells[nPos & m_nMask];
+                    size_t nSequence = c.nSequence.load(std::memory_order_acquire);
+                    intptr_t nDiff = intptr_t(nSequence) - intptr_t(nPos);
+
+                    if (nDiff == 0) {
+                        // Cell is free on this lap, try to claim it
+                        if (m_nTail.value.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed)) {
+                            new (c.ptr()) T(std::move(item));
+                            c.nSequence.store(nPos + 1, std::memory_order_release);
+                            break;
+                        }
+                    } else if (nDiff < 0) {
+                        // Consumer has not emptied this cell yet, so the ring is full
+                        return false;
+                    } else {
+                        // Another producer claimed the cell first
+                        nPos = m_nTail.value.load(std::memory_order_relaxed);
+                    }
+                }
+
+                // Only wake the consumer when it has said it is going to sleep
+                m_waiter.notify();
+                if (m_pSharedWaiter) m_pSharedWaiter->notify();
+
+                return true;
+            }
+
+            // Adds an item to back of queue, yielding while the queue is full
+            // so a slow consumer pushes back on the producing I/O threads
+            void push_back(T &&item)
+            {
+                while (!try_push_back(std::move(item))) std::this_thread::yield();
+            }
+
+            // As above, but gives up once bStop() says the consumer is not coming back,
+            // returns false if the item was dropped
+            template<typename Stop>
+            bool push_back(T &&item, Stop bStop)
+            {
+                while (!try_push_back(std::move(item))) {
+                    if (bStop()) return false;
+                    std::this_thread::yield();
+                }
+                return true;
+            }
+
+            void push_back(const T &item)
+            {
+                push_back(T(item));
+            }
+
+            // Returns true if queue has no items - exact for the consumer
+            bool empty()
+            {
+                size_t nPos = m_nHead.value.load(std::memory_order_relaxed);
+                return m_pCells[nPos & m_nMask].nSequence.load(std::memory_order_acquire) != nPos + 1;
+            }
+
+            // Returns number of items in queue, approximate while producers are pushing
+            size_t count()
+            {
+                size_t nHead = m_nHead.value.load(std::memory_order_acquire);
+                size_t nTail = m_nTail.value.load(std::memory_order_acquire);
+                return nTail > nHead ? nTail - nHead : 0;
+            }
+
+            // Returns maximum number of items the queue can hold
+            size_t capacity() const
+            {
+                return m_nMask + 1;
+            }
+
+            // Clears queue - consumer only
+            void clear()
+            {
+                while (try_pop_front());
+            }
+
+            // Takes every item currently in the queue - consumer only
+            // Anything already in out is discarded
+            size_t drain(std::deque<T> &out)
+            {
+                out.clear();
+                for (size_t n = count(); n > 0; n--) {
+                    std::optional<T> t = try_pop_front();
+                    if (!t) break;
+                    out.push_back(std::move(*t));
+                }
+                return out.size();
+            }
+
+            // Blocks the consumer until the queue has an item
+            void wait()
+            {
+                wait(wait_policy::park());
+            }
+
+            // Waits for an item following the policy, returns false if it timed out
+            bool wait(const wait_policy &policy)
+            {
+                return m_waiter.wait(policy, [this]() { return !empty(); });
+            }
+
+            // Wake-up latency and CPU measurements of the waits so far
+            wait_stats get_wait_stats() const
+            {
+                return m_waiter.stats();
+            }
+
+            // Also wake pWaiter on every push, so one consumer can wait on several queues at once.
+            // Set before anything is pushed
+            void set_shared_waiter(queue_waiter *pWaiter)
+            {
+                m_pSharedWaiter = pWaiter;
+            }
+
+        protected:
+            // Slot in the ring, the item is constructed in place when published
+            struct cell
+            {
+                std::atomic<size_t> nSequence{ 0 };
+                alignas(T) unsigned char storage[sizeof(T)];
+
+                T *ptr() { return reinterpret_cast<T *>(storage); }
+            };
+
+            // Keeps producer and consumer indices on separate cache lines so they do not false share
+            struct alignas(64) padded_index
+            {
+                std::atomic<size_t> value{ 0 };
+            };
+
+            std::unique_ptr<cell[]> m_pCells;
+            size_t m_nMask = 0;
+
+            // Next position the consumer reads
+            padded_index m_nHead;
+            // Next position a producer claims
+            padded_index m_nTail;
+
+            // Puts the consumer to sleep and wakes it up
+            alignas(64) queue_waiter m_waiter;
+            // Waiter shared with other queues, see set_shared_waiter()
+            queue_waiter *m_pSharedWaiter = nullptr;
+        };
+    }
+}
@@ -4,6 +4,9 @@
 #include "net_tsqueue.h"
 #include "net_message.h"
 #include "net_connection.h"
+#include "net_slotmap.h"
+#include "net_udp.h"
+#include "net_dispatch.h"
 
 namespace kim
 {
@@ -15,27 +18,62 @@ namespace kim
         public:
             // Server listens to connections on the endpoint and looks for IPv4 addresses
             server_interface(uint16_t port)
-                : m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+                : m_asioAcceptor(m_asioContext), m_nPort(port)
             {
-                
+
             }
 
             virtual ~server_interface()
             {
+                // The derived class and its OnMessage are gone by now, so the pool must not hand
+                // out anything more. It only still runs if the derived server did not call Stop()
+                if (m_dispatch.size() > 0) {
+                    std::cerr << "[SERVER] Destroyed without Stop(), undelivered messages dropped\n";
+                    m_dispatch.discard();
+                }
+
                 Stop();
             }
 
-            bool Start()
+            // Start the server with a pool of nThreads threads running the ASIO context
+            // (0 uses one thread per hardware core). Each connection runs on its own strand,
+            // so its read/write chain stays serialized no matter which thread picks it up
+            bool Start(size_t nThreads = 1)
             {
                 try {
-                    // Tell ASIO to wait for client connection to prevent 
+                    // Stop() leaves the context stopped, and run() returns at once until it is restarted
+                    m_asioContext.restart();
+
+                    // Workers are up before the first connection is handed their message handler
+                    StartDispatchPool();
+
+                    // Bind the acceptor to the port
+                    asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), m_nPort);
+                    m_asioAcceptor.open(endpoint.protocol());
+                    m_asioAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+                    m_asioAcceptor.bind(endpoint);
+                    m_asioAcceptor.listen();
+
+                    // The unreliable channel shares the port, over UDP
+                    if (m_bUnreliable) {
+                        m_pUdp = std::make_shared<udp_channel<T>>(m_asioContext);
+                        m_pUdp->Open(asio::ip::udp::endpoint(asio::ip::udp::v4(), m_nPort));
+                        m_pUdp->Start();
+                    }
+
+                    // Tell ASIO to wait for client connection to prevent
                     // it from ending immediately when called in a new thread
                     WaitForClientConnection();
 
-                    m_threadContext = std::thread([this]() { m_asioContext.run(); });
+                    if (nThreads == 0) nThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+                    for (size_t i = 0; i < nThreads; i++) {
+                        m_vThreadContext.emplace_back([this]() { m_asioContext.run(); });
+                    }
                 } catch (std::exception &e) {
                     // Something prohibited the server from listening
                     std::cerr << "[SERVER] Exception: " << e.what() << "\n";
+                    m_dispatch.stop();
                     return false;
                 }
 
@@ -43,13 +81,135 @@ namespace kim
                 return true;
             }
 
+            // Start the server in shared-nothing mode: nShards threads (0 uses one per hardware core),
+            // each with its own ASIO context, acceptor, connections and incoming queue. Where the
+            // platform supports SO_REUSEPORT, every shard listens on the port and the kernel balances
+            // new connections between them. Otherwise shard 0 accepts and hands sockets round-robin
+            // to the other shards. OnClientConnect/OnClientValidated run on the owning shard's thread
+            bool StartSharded(size_t nShards = 0)
+            {
+                try {
+                    StartDispatchPool();
+
+                    if (nShards == 0) nShards = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+                    // The shard index is stored in the top bits of every client ID
+                    nShards = std::min(nShards, nMaxShards);
+                    m_nShardTagBits = 0;
+                    while ((size_t(1) << m_nShardTagBits) < nShards) m_nShardTagBits++;
+
+                    asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), m_nPort);
+
+                    // Every shard's queue also wakes Update() and UpdateBatch(), which wait on them all
+                    for (size_t i = 0; i < nShards; i++) {
+                        m_vShards.push_back(std::make_unique<server_shard>(m_nShardTagBits, uint32_t(i)));
+                        m_vShards.back()->qMessagesIn.set_shared_waiter(&m_shardWaiter);
+                    }
+
+#if defined(SO_REUSEPORT)
+                    for (auto &shard : m_vShards) {
+                        shard->acceptor.open(endpoint.protocol());
+                        shard->acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+                        shard->acceptor.set_option(reuse_port(true));
+                        shard->acceptor.bind(endpoint);
+                        shard->acceptor.listen();
+
+                        WaitForShardConnection(*shard);
+                    }
+#else
+                    server_shard &front = *m_vShards.front();
+                    front.acceptor.open(endpoint.protocol());
+                    front.acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+                    front.acceptor.bind(endpoint);
+                    front.acceptor.listen();
+
+                    WaitForShardConnection(front);
+#endif
+
+                    for (auto &shard : m_vShards) {
+                        server_shard *pShard = shard.get();
+                        pShard->thread = std::thread([pShard]() { pShard->context.run(); });
+                    }
+                } catch (std::exception &e) {
+                    std::cerr << "[SERVER] Exception: " << e.what() << "\n";
+                    m_dispatch.stop();
+                    return false;
+                }
+
+                std::cout << "[SERVER] Started " << m_vShards.size() << " shards!\n";
+                return true;
+            }
+
             void Stop()
             {
                 // Request the context to close
                 m_asioContext.stop();
 
-                // Tidy up the context thread;
-                if (m_threadContext.joinable()) m_threadContext.join();
+                // Tidy up the context threads
+                for (auto &thread : m_vThreadContext) {
+                    if (thread.joinable()) thread.join();
+                }
+                m_vThreadContext.clear();
+
+                // Tidy up the shards
+                for (auto &shard : m_vShards) {
+                    shard->context.stop();
+                    if (shard->thread.joinable()) shard->thread.join();
+                }
+
+                // Joining a shared memory thread waits for a handler that may itself take the connection
+                // lock, so the connections are copied out and stopped outside of it
+                std::vector<std::shared_ptr<connection<T>>> vClients;
+                {
+                    std::scoped_lock lock(m_muxConnections);
+                    vClients.reserve(m_mapConnections.size());
+                    for (auto &client : m_mapConnections) vClients.push_back(client);
+                }
+
+                // Shared memory threads hold their connections and still deliver, so they go first
+                for (auto &client : vClients) client->StopSharedMemory();
+                for (auto &shard : m_vShards) {
+                    for (auto &client : shard->mapConnections) client->StopSharedMemory();
+                }
+
+                // A connection's pending operations live in its handler memory, and closing its socket
+                // only queues them. Close everything and run what that completes while the contexts
+                // are still there, so no queued operation is left pointing into a connection that goes
+                m_asioAcceptor.close();
+                if (m_pUdp) m_pUdp->Close();
+                for (auto &client : vClients) client->Disconnect();
+                m_asioContext.restart();
+                m_asioContext.poll();
+
+                for (auto &shard : m_vShards) {
+                    shard->acceptor.close();
+                    for (auto &client : shard->mapConnections) client->Disconnect();
+                    shard->context.restart();
+                    shard->context.poll();
+                }
+
+                // Nothing more can arrive, let the workers finish what has. The next Start() brings
+                // them back, see EnableDispatchPool()
+                m_dispatch.stop();
+
+                // Connections live on strands and timers of their context, so every reference
+                // the server holds goes before any context does. A shard's own connections go with it
+                {
+                    std::scoped_lock lock(m_muxTopics);
+                    m_mapTopics.clear();
+                }
+                {
+                    std::scoped_lock lock(m_muxConnections);
+                    while (!m_mapConnections.empty()) m_mapConnections.erase(m_mapConnections.key_at(0));
+                }
+                m_qMessagesIn.clear();
+                m_deqDrained.clear();
+                m_vBatch.clear();
+                vClients.clear();
+                m_vShards.clear();
+
+                // Its cancelled receive ran in the poll above, and the connections sharing it are gone
+                m_pUdp.reset();
 
                 std::cout << "[SERVER] Stopped!\n";
             }
@@ -58,8 +218,9 @@ namespace kim
             void WaitForClientConnection()
             {
                 // Acceptor object provides a unique socket for incoming connection attempt
-                // It waits until a socket connects
-                m_asioAcceptor.async_accept(
+                // It waits until a socket connects. The socket is bound to a new strand
+                // so that all of the connection's handlers are serialized
+                m_asioAcceptor.async_accept(asio::make_strand(m_asioContext), bind_handler_memory(m_acceptMemory,
                     [this](std::error_code ec, asio::ip::tcp::socket socket)
                     {
                         if (!ec)
@@ -69,20 +230,38 @@ namespace kim
                             std::shared_ptr<connection<T>> newconn =
                                 std::make_shared<connection<T>>(connection<T>::owner::server,
                                     m_asioContext, std::move(socket), m_qMessagesIn);
+                            newconn->SetOutboundLimits(m_outboundLimits);
+                            newconn->SetChunkSize(m_nChunkSize);
+                            newconn->SetMaxFrameSize(m_nMaxFrameSize);
+                            newconn->SetStreaming(m_nStreamPieceSize);
+                            newconn->SetFileDirectory(m_strFileDirectory);
+                            if (m_bCompression) newconn->EnableCompression(m_nCompressThreshold);
+                            if (m_bCoroutines) newconn->EnableCoroutines();
+                            newconn->SetMessageHandler(MessageHandler());
+                            if (m_pUdp) newconn->SetUnreliableChannel(m_pUdp);
+                            newconn->EnableSharedMemory(m_nShmRingSize);
 
                             //Give the user server a chance to deny connections
                             if (OnClientConnect(newconn)) {
-                                // Connection allowed, so add to container of new connections
+                                // Connection allowed, so add to container of new connections,
+                                // whose key becomes the client's ID
                                 // If connection is denied, newconn goes out of scope and is deleted (shared_ptr)
-                                m_deqConnections.push_back(std::move(newconn));
+                                uint64_t nClientID;
+                                {
+                                    std::scoped_lock lock(m_muxConnections);
+                                    nClientID = m_mapConnections.insert(newconn);
+                                }
 
-                                m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
+                                newconn->ConnectToClient(this, nClientID);
 
-                                std::cout << "[" << m_deqConnections.back()->GetID() << "] Connection Approved\n";
+                                std::cout << "[" << nClientID << "] Connection Approved\n";
                             } else {
                                 std::cout << "[-----] Connection Denied\n";
                             }
                         } else {
+                            // The acceptor was closed by Stop()
+                            if (!m_asioAcceptor.is_open()) return;
+
                             // Error has occurred during acceptance
                             std::cout << "[SERVER] New Connection Error: " << ec.message() << "\n";
                         }
@@ -90,49 +269,215 @@ namespace kim
                         // Prime the ASIO context with more work
                         // Simply wait for another connection
                         WaitForClientConnection();
-                    });
+                    }));
             }
 
             // Send a message to a specific client
-            void MessageClient(std::shared_ptr<connection<T>> client, const message<T> &msg)
+            void MessageClient(std::shared_ptr<connection<T>> client, const message<T> &msg,
+                message_priority priority = message_priority::normal)
             {
                 if (client && client->IsConnected()) {
-                    client->Send(msg);
-                } else {
+                    client->Send(msg, priority);
+                } else if (client) {
                     // Limitation of TCP protocol is that we do not know if client was disconnected
                     // Assume it was disconnected if IsConnected() returns false
-                    OnClientDisconnect(client);
-                    client.reset();
-                    m_deqConnections.erase(
-                        std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+                    RemoveClient(client->GetID());
+                }
+            }
+
+            // Send a state update to a specific client over the unreliable channel
+            // (see connection::SendUnreliable)
+            void MessageClientUnreliable(std::shared_ptr<connection<T>> client, const message<T> &msg)
+            {
+                if (client && client->IsConnected()) {
+                    client->SendUnreliable(msg);
+                } else if (client) {
+                    RemoveClient(client->GetID());
+                }
+            }
+
+            // Send a message to the client with the given ID
+            void MessageClient(uint64_t nClientID, const message<T> &msg, message_priority priority = message_priority::normal)
+            {
+                MessageClient(nClientID, make_shared_message(msg), priority);
+            }
+
+            // Send an immutable message to the client with the given ID. The connection is looked up
+            // in place, so no shared_ptr to it is copied on the way
+            void MessageClient(uint64_t nClientID, shared_message<T> msg, message_priority priority = message_priority::normal)
+            {
+                SendToClient(nClientID, std::move(msg), priority, false, 0);
+            }
+
+            // Send a state update to the client with the given ID, replacing any update with the
+            // same key that is still waiting in its outgoing queue (see connection::SendLatest)
+            void MessageClientLatest(uint64_t nClientID, const message<T> &msg, uint64_t nKey,
+                message_priority priority = message_priority::normal)
+            {
+                SendToClient(nClientID, make_shared_message(msg), priority, true, nKey);
+            }
+
+            // Find a connection by the ID it was given when it connected, nullptr if it is gone
+            // Shards keep their connections to their own threads, so this only works unsharded
+            std::shared_ptr<connection<T>> GetClient(uint64_t nClientID)
+            {
+                if (IsSharded()) return nullptr;
+
+                std::scoped_lock lock(m_muxConnections);
+                std::shared_ptr<connection<T>> *client = m_mapConnections.find(nClientID);
+                return client ? *client : nullptr;
+            }
+
+            // Drop a client from the container and tell the user server it has gone
+            void RemoveClient(uint64_t nClientID)
+            {
+                if (IsSharded()) {
+                    server_shard *pShard = ShardOf(nClientID);
+                    if (!pShard) return;
+
+                    asio::post(pShard->context, [this, pShard, nClientID]()
+                        {
+                            std::shared_ptr<connection<T>> pGone = TakeClient(pShard->mapConnections, nClientID);
+                            if (pGone) OnClientDisconnect(pGone);
+                        });
+                } else {
+                    std::shared_ptr<connection<T>> pGone;
+                    {
+                        std::scoped_lock lock(m_muxConnections);
+                        pGone = TakeClient(m_mapConnections, nClientID);
+                    }
+                    if (pGone) OnClientDisconnect(pGone);
                 }
             }
 
             // Send message to all clients
             void MessageAllClients(const message<T> &msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
             {
-                bool bInvalidClientExists = false;
+                // Copy the message once and let every connection queue the same copy
+                MessageAllClients(make_shared_message(msg), pIgnoreClient);
+            }
 
-                for (auto &client : m_deqConnections) {
-                    // Check client is connected
-                    if (client && client->IsConnected()) {
-                        if (client != pIgnoreClient) client->Send(msg);
+            // Send an immutable message to all clients without copying it per client
+            void MessageAllClients(shared_message<T> msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+            {
+                if (IsSharded()) {
+                    // Each shard walks its own connections on its own thread, so no lock is needed
+                    for (auto &shard : m_vShards) {
+                        server_shard *pShard = shard.get();
+                        asio::post(pShard->context, [this, pShard, msg, pIgnoreClient]()
+                            {
+                                std::vector<std::shared_ptr<connection<T>>> vGone = MessageConnections(pShard->mapConnections, msg, pIgnoreClient);
+                                for (auto &client : vGone) OnClientDisconnect(client);
+                            });
+                    }
+                } else {
+                    // Callbacks run after the lock is released, so they may message clients themselves
+                    std::vector<std::shared_ptr<connection<T>>> vGone;
+                    {
+                        std::scoped_lock lock(m_muxConnections);
+                        vGone = MessageConnections(m_mapConnections, msg, pIgnoreClient);
+                    }
+                    for (auto &client : vGone) OnClientDisconnect(client);
+                }
+            }
+
+            // Add a client to a topic, so it receives everything published to it
+            void Subscribe(uint32_t nTopic, std::shared_ptr<connection<T>> client)
+            {
+                if (!client) return;
+
+                std::scoped_lock lock(m_muxTopics);
+                topic_group &group = m_mapTopics[nTopic];
+                if (group.mapIndex.count(client->GetID())) return;
+
+                group.mapIndex[client->GetID()] = group.vMembers.size();
+                group.vMembers.push_back(std::move(client));
+            }
+
+            // Take a client out of a topic
+            void Unsubscribe(uint32_t nTopic, uint64_t nClientID)
+            {
+                std::scoped_lock lock(m_muxTopics);
+                auto it = m_mapTopics.find(nTopic);
+                if (it == m_mapTopics.end()) return;
+
+                LeaveTopic(it->second, nClientID);
+                if (it->second.vMembers.empty()) m_mapTopics.erase(it);
+            }
+
+            // Take a client out of every topic, e.g. from OnClientDisconnect
+            void UnsubscribeAll(uint64_t nClientID)
+            {
+                std::scoped_lock lock(m_muxTopics);
+                for (auto it = m_mapTopics.begin(); it != m_mapTopics.end();) {
+                    LeaveTopic(it->second, nClientID);
+                    if (it->second.vMembers.empty()) it = m_mapTopics.erase(it);
+                    else ++it;
+                }
+            }
+
+            // Number of clients subscribed to a topic
+            size_t SubscriberCount(uint32_t nTopic)
+            {
+                std::scoped_lock lock(m_muxTopics);
+                auto it = m_mapTopics.find(nTopic);
+                return it == m_mapTopics.end() ? 0 : it->second.vMembers.size();
+            }
+
+            // Send a message to the subscribers of a topic only. Returns how many it was queued on
+            size_t Publish(uint32_t nTopic, const message<T> &msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+            {
+                // Copy the message once and let every subscriber queue the same copy
+                return Publish(nTopic, make_shared_message(msg), pIgnoreClient);
+            }
+
+            // Send an immutable message to the subscribers of a topic. The cost is a walk over the
+            // topic's packed member list, however many clients are connected in total. Subscribers
+            // that have disconnected are dropped from the topic; the connection container still
+            // reports them through OnClientDisconnect as usual
+            size_t Publish(uint32_t nTopic, const shared_message<T> &msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+            {
+                std::scoped_lock lock(m_muxTopics);
+                auto it = m_mapTopics.find(nTopic);
+                if (it == m_mapTopics.end()) return 0;
+
+                topic_group &group = it->second;
+                size_t nSent = 0;
+
+                for (size_t i = 0; i < group.vMembers.size();) {
+                    std::shared_ptr<connection<T>> &client = group.vMembers[i];
+
+                    if (client->IsConnected()) {
+                        if (client != pIgnoreClient) {
+                            client->Send(msg);
+                            nSent++;
+                        }
+                        i++;
                     } else {
-                        // Assumed that client was disconnected
-                        OnClientDisconnect(client);
-                        client.reset();
-                        bInvalidClientExists = true;
+                        // Leaving moves the last member into this position, so do not advance
+                        LeaveTopic(group, client->GetID());
                     }
                 }
 
-                if (bInvalidClientExists) m_deqConnections.erase(
-                    std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+                if (group.vMembers.empty()) m_mapTopics.erase(it);
+                return nSent;
             }
 
             void Update(size_t nMaxMessages = -1, bool bWait = false)
             {
+                if (IsSharded()) {
+                    // Wait until any shard has a message, then visit every shard
+                    if (bWait && !WaitForShards()) return;
+
+                    size_t nMessageCount = 0;
+                    for (size_t i = 0; i < m_vShards.size() && nMessageCount < nMaxMessages; i++) {
+                        nMessageCount += UpdateShard(i, nMaxMessages - nMessageCount, false);
+                    }
+                    return;
+                }
+
                 // Prevents server from occupying 100% of a CPU core
-                if (bWait) m_qMessagesIn.wait();
+                if (bWait && !m_qMessagesIn.wait(m_waitPolicy)) return;
 
                 size_t nMessageCount = 0;
 
@@ -142,11 +487,193 @@ namespace kim
 
                     // Pass to message handler
                     OnMessage(msg.remote, msg.msg);
-                    
+
                     nMessageCount++;
                 }
             }
 
+            // Batch alternative to Update(): takes everything pending with one lock, moves it into a
+            // contiguous batch and hands it to OnMessageBatch() with a single call. When grouping, the
+            // batch is ordered by client while each client's messages stay in arrival order
+            size_t UpdateBatch(bool bWait = false, bool bGroupByClient = false)
+            {
+                m_vBatch.clear();
+
+                if (IsSharded()) {
+                    if (bWait && !WaitForShards()) return 0;
+
+                    for (auto &shard : m_vShards) {
+                        shard->qMessagesIn.drain(m_deqDrained);
+                        for (auto &msg : m_deqDrained) m_vBatch.push_back(std::move(msg));
+                    }
+                } else {
+                    if (bWait && !m_qMessagesIn.wait(m_waitPolicy)) return 0;
+
+                    m_qMessagesIn.drain(m_deqDrained);
+                    for (auto &msg : m_deqDrained) m_vBatch.push_back(std::move(msg));
+                }
+
+                if (m_vBatch.empty()) return 0;
+
+                if (bGroupByClient) {
+                    std::stable_sort(m_vBatch.begin(), m_vBatch.end(),
+                        [](const owned_message<T> &a, const owned_message<T> &b)
+                        {
+                            return a.remote.get() < b.remote.get();
+                        });
+                }
+
+                OnMessageBatch(m_vBatch);
+                return m_vBatch.size();
+            }
+
+            // Handle messages received by a single shard. Running one updating thread per shard
+            // keeps the whole path shared-nothing, in which case OnMessage must be thread safe
+            size_t UpdateShard(size_t nShard, size_t nMaxMessages = -1, bool bWait = false)
+            {
+                incoming_queue<T> &qMessagesIn = m_vShards[nShard]->qMessagesIn;
+
+                if (bWait && !qMessagesIn.wait(m_waitPolicy)) return 0;
+
+                size_t nMessageCount = 0;
+
+                while (nMessageCount < nMaxMessages && !qMessagesIn.empty()) {
+                    auto msg = qMessagesIn.pop_front();
+                    OnMessage(msg.remote, msg.msg);
+                    nMessageCount++;
+                }
+
+                return nMessageCount;
+            }
+
+            // Bound the outgoing queue of every connection accepted from now on
+            void SetOutboundLimits(const outbound_limits &limits)
+            {
+                m_outboundLimits = limits;
+            }
+
+            // Chunk size given to every connection accepted from now on (see connection::SetChunkSize)
+            void SetChunkSize(size_t nBytes)
+            {
+                m_nChunkSize = nBytes;
+            }
+
+            // Incoming body limit and streaming piece size given to every connection accepted
+            // from now on (see connection::SetMaxFrameSize and connection::SetStreaming)
+            void SetMaxFrameSize(size_t nBytes)
+            {
+                m_nMaxFrameSize = nBytes;
+            }
+
+            void SetStreaming(size_t nBytes)
+            {
+                m_nStreamPieceSize = nBytes;
+            }
+
+            // Directory every connection accepted from now on writes received files to
+            // (see connection::SetFileDirectory)
+            void SetFileDirectory(const std::string &strDirectory)
+            {
+                m_strFileDirectory = strDirectory;
+            }
+
+            // Open a UDP channel on the server's port when it starts, and offer it to every
+            // connection (see connection::SendUnreliable). Call before Start(); a server started
+            // with StartSharded() has no channel and SendUnreliable() falls back to TCP
+            void EnableUnreliable()
+            {
+                m_bUnreliable = true;
+            }
+
+            // Offer the shared memory transport to every connection accepted from now on that
+            // comes from this host (see connection::EnableSharedMemory)
+            void EnableSharedMemory(size_t nRingBytes = 1024 * 1024)
+            {
+                m_nShmRingSize = nRingBytes;
+            }
+
+            // Offer compression on every connection accepted from now on
+            // (see connection::EnableCompression)
+            void EnableCompression(size_t nThreshold = 1024)
+            {
+                m_bCompression = true;
+                m_nCompressThreshold = nThreshold;
+            }
+
+            // Run every connection accepted from now on with the coroutine engine
+            // (see connection::EnableCoroutines)
+            void EnableCoroutines()
+            {
+                m_bCoroutines = true;
+            }
+
+            // Call OnMessage directly on the thread that delivered each message, for every connection
+            // accepted from now on, skipping the incoming queue and the wake-up of the thread calling
+            // Update(). The message is lent by reference (see connection::SetMessageHandler), so it
+            // is not copied. That is an I/O thread or a shared memory reader thread, and calls for
+            // one client may overlap once it uses shared memory, so OnMessage must be thread safe.
+            // It should return quickly, as the thread delivers nothing more until it does
+            void EnableInlineDispatch()
+            {
+                m_bInlineDispatch = true;
+            }
+
+            // Call OnMessage on a pool of nWorkers threads (0 uses one per hardware core) instead of
+            // from Update(). Each client's messages are handled in order, one at a time, while
+            // different clients are handled in parallel, so OnMessage must be thread safe. The
+            // workers start with the server and are joined by Stop(), and every later Start() brings
+            // them back, idle workers waiting as the wait policy set by then says. Call before
+            // starting the server: returns false, changing nothing, once it runs. The workers call
+            // OnMessage until Stop() has drained them, so a derived server must call Stop() in its
+            // own destructor
+            bool EnableDispatchPool(size_t nWorkers = 0)
+            {
+                if (IsRunning()) return false;
+
+                m_bDispatchPool = true;
+                m_nDispatchWorkers = nWorkers;
+                return true;
+            }
+
+            // What the dispatch pool has done so far
+            dispatch_stats GetDispatchStats() const
+            {
+                return m_dispatch.stats();
+            }
+
+            // Choose how Update(), UpdateBatch() and UpdateShard() wait when asked to.
+            // A policy with a timeout makes them return empty handed once it expires
+            void SetWaitPolicy(const wait_policy &policy)
+            {
+                m_waitPolicy = policy;
+            }
+
+            // Wake-up latency and CPU measurements of the incoming queue, or of the waits
+            // on every shard's queue when sharded
+            wait_stats GetWaitStats()
+            {
+                if (IsSharded()) return m_shardWaiter.stats();
+                return m_qMessagesIn.get_wait_stats();
+            }
+
+            // Has the server been started, and not stopped since
+            bool IsRunning() const
+            {
+                return !m_vThreadContext.empty() || !m_vShards.empty();
+            }
+
+            // Is the server running in shared-nothing mode
+            bool IsSharded() const
+            {
+                return !m_vShards.empty();
+            }
+
+            // Number of shards, 0 when not sharded
+            size_t ShardCount() const
+            {
+                return m_vShards.size();
+            }
+
             // Called when a client is validated
             virtual void OnClientValidated(std::shared_ptr<connection<T>> client)
             {
@@ -166,29 +693,324 @@ namespace kim
 
             }
 
-            // Called when a message arrives 
+            // Called when a message arrives
             virtual void OnMessage(std::shared_ptr<connection<T>> client, message<T> &msg)
             {
 
             }
 
-            // Thread safe queue for incoming message packets
-            tsqueue<owned_message<T>> m_qMessagesIn;
+            // Called by UpdateBatch() with every message drained in one go. Override to amortize
+            // per-message work across the batch; by default each message goes to OnMessage()
+            virtual void OnMessageBatch(std::vector<owned_message<T>> &vMessages)
+            {
+                for (auto &msg : vMessages) {
+                    OnMessage(msg.remote, msg.msg);
+                }
+            }
+
+        private:
+#if defined(SO_REUSEPORT)
+            // Lets several acceptors bind the same port, with the kernel load balancing between them
+            typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+            // Container of connections keyed by client ID
+            typedef slot_map<std::shared_ptr<connection<T>>> connection_map;
+
+            // Members of a topic, packed so publishing is a linear walk. The index map
+            // finds a member's position for O(1) swap-and-pop removal
+            struct topic_group
+            {
+                std::vector<std::shared_ptr<connection<T>>> vMembers;
+                std::unordered_map<uint64_t, size_t> mapIndex;
+            };
+
+            // The shard index takes the bits of a client ID that the slot map leaves for a tag
+            static constexpr size_t nMaxShards = 256;
+
+            // Everything a shard owns. Only the shard's own thread touches its connections
+            struct server_shard
+            {
+                server_shard(uint32_t nTagBits, uint32_t nTag)
+                    : mapConnections(nTagBits, nTag)
+                {
+
+                }
+
+                // Declared first so it outlives any accept still pending when the context goes
+                handler_memory acceptMemory;
+                asio::io_context context;
+                asio::ip::tcp::acceptor acceptor{ context };
+                connection_map mapConnections;
+                incoming_queue<T> qMessagesIn;
+                std::thread thread;
+            };
+
+            // Asynchronous - instruct a shard's acceptor to wait for connection
+            void WaitForShardConnection(server_shard &shard)
+            {
+                // Pick the shard that will own the socket, which is always this shard
+                // when every shard has its own acceptor
+#if defined(SO_REUSEPORT)
+                server_shard &owner = shard;
+#else
+                server_shard &owner = *m_vShards[m_nNextShard++ % m_vShards.size()];
+#endif
+
+                shard.acceptor.async_accept(owner.context, bind_handler_memory(shard.acceptMemory,
+                    [this, &shard, &owner](std::error_code ec, asio::ip::tcp::socket socket)
+                    {
+                        if (!ec) {
+                            if (&owner == &shard) {
+                                AddShardConnection(owner, std::move(socket));
+                            } else {
+                                // Hand the socket over so the owning shard registers it on its own thread
+                                asio::post(owner.context, [this, &owner, socket = std::move(socket)]() mutable
+                                    {
+                                        AddShardConnection(owner, std::move(socket));
+                                    });
+                            }
+                        } else {
+                            // The acceptor was closed by Stop()
+                            if (!shard.acceptor.is_open()) return;
+
+                            std::cout << "[SERVER] New Connection Error: " << ec.message() << "\n";
+                        }
+
+                        WaitForShardConnection(shard);
+                    }));
+            }
+
+            // Register a freshly accepted socket with the shard that owns it
+            void AddShardConnection(server_shard &shard, asio::ip::tcp::socket socket)
+            {
+                std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << "\n";
+
+                std::shared_ptr<connection<T>> newconn =
+                    std::make_shared<connection<T>>(connection<T>::owner::server,
+                        shard.context, std::move(socket), shard.qMessagesIn);
+                newconn->SetOutboundLimits(m_outboundLimits);
+                newconn->SetChunkSize(m_nChunkSize);
+                newconn->SetMaxFrameSize(m_nMaxFrameSize);
+                newconn->SetStreaming(m_nStreamPieceSize);
+                newconn->SetFileDirectory(m_strFileDirectory);
+                if (m_bCompression) newconn->EnableCompression(m_nCompressThreshold);
+                if (m_bCoroutines) newconn->EnableCoroutines();
+                newconn->SetMessageHandler(MessageHandler());
+                newconn->EnableSharedMemory(m_nShmRingSize);
+
+                if (OnClientConnect(newconn)) {
+                    uint64_t nClientID = shard.mapConnections.insert(newconn);
+
+                    newconn->ConnectToClient(this, nClientID);
+
+                    std::cout << "[" << nClientID << "] Connection Approved\n";
+                } else {
+                    std::cout << "[-----] Connection Denied\n";
+                }
+            }
+
+            // Start the workers of the dispatch pool, if one was asked for
+            void StartDispatchPool()
+            {
+                if (!m_bDispatchPool) return;
+
+                m_dispatch.start(m_nDispatchWorkers, [this](std::shared_ptr<connection<T>> client, message<T> &msg)
+                    {
+                        OnMessage(std::move(client), msg);
+                    }, m_waitPolicy);
+            }
+
+            // Message handler given to new connections, none when they queue for Update()
+            typename connection<T>::message_handler MessageHandler()
+            {
+                if (m_dispatch.size() > 0) {
+                    return [this](std::shared_ptr<connection<T>> client, message<T> &msg)
+                        {
+                            m_dispatch.post(std::move(client), std::move(msg));
+                        };
+                }
+
+                if (m_bInlineDispatch) {
+                    return [this](std::shared_ptr<connection<T>> client, message<T> &msg)
+                        {
+                            OnMessage(std::move(client), msg);
+                        };
+                }
+
+                return nullptr;
+            }
+
+            // Wait as the wait policy says until any shard has a message, false if it timed out
+            bool WaitForShards()
+            {
+                return m_shardWaiter.wait(m_waitPolicy, [this]()
+                    {
+                        for (auto &shard : m_vShards) {
+                            if (!shard->qMessagesIn.empty()) return true;
+                        }
+                        return false;
+                    });
+            }
+
+            // Shard that handed out a client ID
+            server_shard *ShardOf(uint64_t nClientID)
+            {
+                uint32_t nShard = connection_map::tag_of(nClientID, m_nShardTagBits);
+                return nShard < m_vShards.size() ? m_vShards[nShard].get() : nullptr;
+            }
+
+            // Take a client out of a container, returns nullptr if it is not there
+            std::shared_ptr<connection<T>> TakeClient(connection_map &mapConnections, uint64_t nClientID)
+            {
+                std::shared_ptr<connection<T>> *client = mapConnections.find(nClientID);
+                if (!client) return nullptr;
+
+                std::shared_ptr<connection<T>> pGone = std::move(*client);
+                mapConnections.erase(nClientID);
+                return pGone;
+            }
 
-            // Container of active and validated connections
-            std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
+            // Look up a client where its connection lives and queue a message on it,
+            // conflated by nKey when bLatest is set
+            void SendToClient(uint64_t nClientID, shared_message<T> msg, message_priority priority, bool bLatest, uint64_t nKey)
+            {
+                if (IsSharded()) {
+                    // Only the owning shard's thread may look into its container
+                    server_shard *pShard = ShardOf(nClientID);
+                    if (!pShard) return;
+
+                    asio::post(pShard->context, [this, pShard, nClientID, msg = std::move(msg), priority, bLatest, nKey]() mutable
+                        {
+                            std::shared_ptr<connection<T>> pGone = SendOrTake(pShard->mapConnections, nClientID, std::move(msg), priority, bLatest, nKey);
+                            if (pGone) OnClientDisconnect(pGone);
+                        });
+                } else {
+                    std::shared_ptr<connection<T>> pGone;
+                    {
+                        std::scoped_lock lock(m_muxConnections);
+                        pGone = SendOrTake(m_mapConnections, nClientID, std::move(msg), priority, bLatest, nKey);
+                    }
+                    if (pGone) OnClientDisconnect(pGone);
+                }
+            }
+
+            // Send to a client in a container, or take it out if it has disconnected
+            std::shared_ptr<connection<T>> SendOrTake(connection_map &mapConnections, uint64_t nClientID, shared_message<T> msg,
+                message_priority priority, bool bLatest, uint64_t nKey)
+            {
+                std::shared_ptr<connection<T>> *client = mapConnections.find(nClientID);
+                if (!client) return nullptr;
+
+                if ((*client)->IsConnected()) {
+                    if (bLatest) (*client)->SendLatest(std::move(msg), nKey, priority);
+                    else (*client)->Send(std::move(msg), priority);
+                    return nullptr;
+                }
+
+                return TakeClient(mapConnections, nClientID);
+            }
+
+            // Send a message to every connection in a container, taking out and
+            // returning the ones that went away
+            std::vector<std::shared_ptr<connection<T>>> MessageConnections(connection_map &mapConnections,
+                const shared_message<T> &msg, const std::shared_ptr<connection<T>> &pIgnoreClient)
+            {
+                std::vector<std::shared_ptr<connection<T>>> vGone;
+
+                for (size_t i = 0; i < mapConnections.size();) {
+                    std::shared_ptr<connection<T>> &client = mapConnections[i];
+
+                    // Check client is connected
+                    if (client->IsConnected()) {
+                        if (client != pIgnoreClient) client->Send(msg);
+                        i++;
+                    } else {
+                        // Assumed that client was disconnected. Erasing moves the
+                        // last connection into this position, so do not advance
+                        vGone.push_back(std::move(client));
+                        mapConnections.erase(mapConnections.key_at(i));
+                    }
+                }
+
+                return vGone;
+            }
+
+            // Remove a client from a topic's member list
+            void LeaveTopic(topic_group &group, uint64_t nClientID)
+            {
+                auto it = group.mapIndex.find(nClientID);
+                if (it == group.mapIndex.end()) return;
+
+                size_t nIndex = it->second;
+                group.mapIndex.erase(it);
+
+                if (nIndex != group.vMembers.size() - 1) {
+                    group.vMembers[nIndex] = std::move(group.vMembers.back());
+                    group.mapIndex[group.vMembers[nIndex]->GetID()] = nIndex;
+                }
+                group.vMembers.pop_back();
+            }
+
+        protected:
+            // Thread safe queue for incoming message packets
+            incoming_queue<T> m_qMessagesIn;
+
+            // How the update functions wait for messages
+            wait_policy m_waitPolicy;
+
+            // Outgoing queue bounds given to new connections
+            outbound_limits m_outboundLimits;
+            size_t m_nChunkSize = 0;
+            size_t m_nMaxFrameSize = connection<T>::nDefaultMaxFrameSize;
+            size_t m_nStreamPieceSize = 0;
+            std::string m_strFileDirectory;
+            bool m_bCompression = false;
+            size_t m_nCompressThreshold = 0;
+            size_t m_nShmRingSize = 0;
+            bool m_bCoroutines = false;
+            bool m_bInlineDispatch = false;
+
+            // Workers running OnMessage while the server runs, see EnableDispatchPool()
+            bool m_bDispatchPool = false;
+            size_t m_nDispatchWorkers = 0;
+            dispatch_pool<T> m_dispatch;
+
+            // Reused storage for UpdateBatch(), so draining does not allocate once warmed up
+            std::deque<owned_message<T>> m_deqDrained;
+            std::vector<owned_message<T>> m_vBatch;
+
+            // Container of active and validated connections, keyed by client ID
+            connection_map m_mapConnections;
+            std::mutex m_muxConnections;
+
+            // Subscribers of each topic. Connections may be sent to from any thread,
+            // so topics span every shard of a sharded server
+            std::unordered_map<uint32_t, topic_group> m_mapTopics;
+            std::mutex m_muxTopics;
 
             // Order of declaration is imporant - it is also the order of initialization
+            // Memory of the accept handlers, it has to outlive the context
+            handler_memory m_acceptMemory;
             asio::io_context m_asioContext;
-            std::thread m_threadContext;
+            std::vector<std::thread> m_vThreadContext;
 
             // These things need an ASIO context
             asio::ip::tcp::acceptor m_asioAcceptor;
+            uint16_t m_nPort = 0;
+
+            // Unreliable channel shared by the connections, see EnableUnreliable()
+            bool m_bUnreliable = false;
+            std::shared_ptr<udp_channel<T>> m_pUdp;
 
-            // Clients will be identified in the "wider system" via an ID
-            uint32_t nIDCounter = 10000;
+            // Woken by every shard's queue, see WaitForShards(). Declared first, as the queues point to it
+            queue_waiter m_shardWaiter;
+            // Shards of a server started with StartSharded(), empty otherwise
+            std::vector<std::unique_ptr<server_shard>> m_vShards;
+            uint32_t m_nShardTagBits = 0;
+            size_t m_nNextShard = 0;
 
 
         };
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "net_common.h"
+
+#ifdef KIM_NET_HAS_SHM
+namespace kim
+{
+    namespace net
+    {
+        // One direction of a shared memory transport: a byte pipe with a single writer and a single
+        // reader, possibly in different processes. Positions only ever grow, the byte at position n
+        // lives at n % capacity. Either side spins briefly when it has to wait, then sleeps on a
+        // futex word that the other side bumps only when it knows someone is asleep on it
+        class shm_ring
+        {
+        public:
+            // Shared state at the start of the ring, each side's fields on their own cache line
+            struct control
+            {
+                // Bytes written so far, and the futex word the reader sleeps on
+                alignas(64) std::atomic<uint64_t> nHead{ 0 };
+                std::atomic<uint32_t> nDataSignal{ 0 };
+                std::atomic<uint32_t> nReaderAsleep{ 0 };
+                // Bytes read so far, and the futex word the writer sleeps on
+                alignas(64) std::atomic<uint64_t> nTail{ 0 };
+                std::atomic<uint32_t> nSpaceSignal{ 0 };
+                std::atomic<uint32_t> nWriterAsleep{ 0 };
+            };
+
+            shm_ring() = default;
+
+            // nCapacity must be a power of two
+            shm_ring(control *pControl, uint8_t *pData, size_t nCapacity)
+                : m_pControl(pControl), m_pData(pData), m_nCapacity(nCapacity)
+            {
+
+            }
+
+            // Copy nBytes in, waiting for room as long as keepWaiting() returns true
+            // Returns false if it gave up before everything was written, or if the reader's
+            // position is not one it could have reached, as the other process may be broken
+            template<typename Predicate>
+            bool write(const void *pSrc, size_t nBytes, Predicate keepWaiting)
+            {
+                const uint8_t *p = static_cast<const uint8_t *>(pSrc);
+                uint64_t nHead = m_pControl->nHead.load(std::memory_order_relaxed);
+
+                while (nBytes > 0) {
+                    uint64_t nUsed = nHead - m_pControl->nTail.load(std::memory_order_acquire);
+                    if (nUsed > m_nCapacity) return false;
+
+                    uint64_t nFree = m_nCapacity - nUsed;
+                    if (nFree == 0) {
+                        auto hasRoom = [&]() { return m_pControl->nTail.load(std::memory_order_acquire) + m_nCapacity != nHead; };
+                        if (!wait(m_pControl->nSpaceSignal, m_pControl->nWriterAsleep, hasRoom, keepWaiting)) return false;
+                        continue;
+                    }
+
+                    size_t nPut = size_t(std::min<uint64_t>(nBytes, nFree));
+                    copy_in(nHead, p, nPut);
+                    nHead += nPut;
+                    p += nPut;
+                    nBytes -= nPut;
+
+                    m_pControl->nHead.store(nHead, std::memory_order_release);
+                    signal(m_pControl->nDataSignal, m_pControl->nReaderAsleep);
+                }
+
+                return true;
+            }
+
+            // Copy nBytes out, waiting for them to arrive as long as keepWaiting() returns true
+            // Returns false if it gave up before everything was read, or if the writer claims
+            // more than the ring holds
+            template<typename Predicate>
+            bool read(void *pDst, size_t nBytes, Predicate keepWaiting)
+            {
+                uint8_t *p = static_cast<uint8_t *>(pDst);
+                uint64_t nTail = m_pControl->nTail.load(std::memory_order_relaxed);
+
+                while (nBytes > 0) {
+                    uint64_t nReady = m_pControl->nHead.load(std::memory_order_acquire) - nTail;
+                    if (nReady > m_nCapacity) return false;
+                    if (nReady == 0) {
+                        auto hasData = [&]() { return m_pControl->nHead.load(std::memory_order_acquire) != nTail; };
+                        if (!wait(m_pControl->nDataSignal, m_pControl->nReaderAsleep, hasData, keepWaiting)) return false;
+                        continue;
+                    }
+
+                    size_t nTake = size_t(std::min<uint64_t>(nBytes, nReady));
+                    copy_out(nTail, p, nTake);
+                    nTail += nTake;
+                    p += nTake;
+                    nBytes -= nTake;
+
+                    m_pControl->nTail.store(nTail, std::memory_order_release);
+                    signal(m_pControl->nSpaceSignal, m_pControl->nWriterAsleep);
+                }
+
+                return true;
+            }
+
+            // Wake the reader so it checks whether it should stop
+            void wake_reader()
+            {
+                m_pControl->nDataSignal.fetch_add(1, std::memory_order_seq_cst);
+                futex_wake(m_pControl->nDataSignal);
+            }
+
+        private:
+            // Spins before sleeping, and how long a sleep lasts before keepWaiting() is asked again
+            static constexpr size_t nSpin = 2000;
+            static constexpr long nSleepNs = 50 * 1000 * 1000;
+
+            void copy_in(uint64_t nAt, const uint8_t *pSrc, size_t nBytes)
+            {
+                size_t nPos = size_t(nAt & (m_nCapacity - 1));
+                size_t nFirst = std::min(nBytes, m_nCapacity - nPos);
+                std::memcpy(m_pData + nPos, pSrc, nFirst);
+                if (nBytes > nFirst) std::memcpy(m_pData, pSrc + nFirst, nBytes - nFirst);
+            }
+
+            void copy_out(uint64_t nAt, uint8_t *pDst, size_t nBytes)
+            {
+                size_t nPos = size_t(nAt & (m_nCapacity - 1));
+                size_t nFirst = std::min(nBytes, m_nCapacity - nPos);
+                std::memcpy(pDst, m_pData + nPos, nFirst);
+                if (nBytes > nFirst) std::memcpy(pDst + nFirst, m_pData, nBytes - nFirst);
+            }
+
+            // Called after publishing: only a side that announced it is asleep costs a syscall
+            static void signal(std::atomic<uint32_t> &nWord, std::atomic<uint32_t> &nAsleep)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (nAsleep.load(std::memory_order_relaxed)) {
+                    nWord.fetch_add(1, std::memory_order_relaxed);
+                    futex_wake(nWord);
+                }
+            }
+
+            // The word is read before announcing the sleep, so a signal sent in between
+            // changes it and the futex wait returns straight away
+            template<typename Ready, typename Predicate>
+            static bool wait(std::atomic<uint32_t> &nWord, std::atomic<uint32_t> &nAsleep, Ready ready, Predicate keepWaiting)
+            {
+                for (size_t i = 0; i < nSpin; i++) {
+                    if (ready()) return true;
+                }
+
+                while (keepWaiting()) {
+                    uint32_t nSignal = nWord.load(std::memory_order_relaxed);
+                    nAsleep.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                    if (!ready()) futex_wait(nWord, nSignal);
+                    nAsleep.store(0, std::memory_order_relaxed);
+
+                    if (ready()) return true;
+                }
+
+                return false;
+            }
+
+            // Futex words are shared between processes, so the non-private operations are used
+            static void futex_wait(std::atomic<uint32_t> &nWord, uint32_t nExpected)
+            {
+                timespec timeout{ 0, nSleepNs };
+                ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&nWord), FUTEX_WAIT, nExpected, &timeout, nullptr, 0);
+            }
+
+            static void futex_wake(std::atomic<uint32_t> &nWord)
+            {
+                ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&nWord), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+            }
+
+            control *m_pControl = nullptr;
+            uint8_t *m_pData = nullptr;
+            size_t m_nCapacity = 0;
+        };
+
+        // POSIX shared memory segment holding the two rings of a connection: ring 0 carries
+        // client to server, ring 1 server to client. The client creates it under a name both
+        // sides derive from the handshake, the server opens it, and the name is unlinked once
+        // both have it mapped
+        class shm_segment
+        {
+        public:
+            shm_segment() = default;
+            shm_segment(const shm_segment &) = delete;
+            shm_segment &operator = (const shm_segment &) = delete;
+
+            ~shm_segment()
+            {
+                close();
+            }
+
+            // Create and map a new segment with rings of nRingSize bytes (rounded up to a power of two)
+            bool create(const std::string &strName, size_t nRingSize)
+            {
+                size_t nCapacity = 4096;
+                while (nCapacity < nRingSize) nCapacity <<= 1;
+
+                int nFile = ::shm_open(strName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                if (nFile < 0) return false;
+
+                m_strName = strName;
+                m_bLinked = true;
+
+                bool bMapped = ::ftruncate(nFile, off_t(segment_size(nCapacity))) == 0 && map(nFile, nCapacity);
+                ::close(nFile);
+                if (!bMapped) {
+                    close();
+                    return false;
+                }
+
+                header *pHeader = reinterpret_cast<header *>(m_pBase);
+                pHeader->nMagic = nMagic;
+                pHeader->nRingSize = nCapacity;
+                for (size_t i = 0; i < 2; i++) new (m_pBase + ring_offset(nCapacity, i)) shm_ring::control();
+                return true;
+            }
+
+            // Map a segment made by the other side, then unlink its name
+            bool open(const std::string &strName)
+            {
+                int nFile = ::shm_open(strName.c_str(), O_RDWR, 0600);
+                if (nFile < 0) return false;
+
+                // Check the size first, the segment comes from another process
+                struct stat st;
+                header hdr{};
+                bool bValid = ::fstat(nFile, &st) == 0 && size_t(st.st_size) >= sizeof(header) &&
+                    ::pread(nFile, &hdr, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+                    hdr.nMagic == nMagic && hdr.nRingSize >= 4096 && (hdr.nRingSize & (hdr.nRingSize - 1)) == 0 &&
+                    size_t(st.st_size) == segment_size(size_t(hdr.nRingSize));
+
+                bValid = bValid && map(nFile, size_t(hdr.nRingSize));
+                ::close(nFile);
+                ::shm_unlink(strName.c_str());
+                return bValid;
+            }
+
+            // Remove the name, the mapping stays until close()
+            void unlink()
+            {
+                if (m_bLinked) ::shm_unlink(m_strName.c_str());
+                m_bLinked = false;
+            }
+
+            void close()
+            {
+                unlink();
+                if (m_pBase) ::munmap(m_pBase, m_nSize);
+                m_pBase = nullptr;
+                m_nSize = 0;
+            }
+
+            bool is_open() const
+            {
+                return m_pBase != nullptr;
+            }
+
+            shm_ring ring(size_t nIndex)
+            {
+                size_t nOffset = ring_offset(m_nCapacity, nIndex);
+                return shm_ring(reinterpret_cast<shm_ring::control *>(m_pBase + nOffset),
+                    m_pBase + nOffset + nControlSize, m_nCapacity);
+            }
+
+        private:
+            struct header
+            {
+                uint64_t nMagic;
+                uint64_t nRingSize;
+            };
+
+            static constexpr uint64_t nMagic = 0x6B696D5F73686D31;
+            static constexpr size_t nHeaderSize = 64;
+            static constexpr size_t nControlSize = (sizeof(shm_ring::control) + 63) / 64 * 64;
+
+            static size_t ring_offset(size_t nCapacity, size_t nIndex)
+            {
+                return nHeaderSize + nIndex * (nControlSize + nCapacity);
+            }
+
+            static size_t segment_size(size_t nCapacity)
+            {
+                return ring_offset(nCapacity, 2);
+            }
+
+            bool map(int nFile, size_t nCapacity)
+            {
+                void *pMap = ::mmap(nullptr, segment_size(nCapacity), PROT_READ | PROT_WRITE, MAP_SHARED, nFile, 0);
+                if (pMap == MAP_FAILED) return false;
+
+                m_pBase = static_cast<uint8_t *>(pMap);
+                m_nSize = segment_size(nCapacity);
+                m_nCapacity = nCapacity;
+                return true;
+            }
+
+            uint8_t *m_pBase = nullptr;
+            size_t m_nSize = 0;
+            size_t m_nCapacity = 0;
+            std::string m_strName;
+            bool m_bLinked = false;
+        };
+    }
+}
+#endif
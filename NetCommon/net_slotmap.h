@@ -0,0 +1,142 @@
+#pragma once
+
+#include "net_common.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // Generational slot map handing out 64 bit keys with O(1) insert, lookup and erase
+        // Values are kept densely packed so iterating over all of them is a linear walk.
+        // A key is laid out as [tag | generation | index]: the low 20 bits pick a slot, the
+        // next 32 hold a generation that changes every time the slot is reused, so a stale key
+        // is only mistaken for a live one after 2^32 - 1 reuses, and an optional fixed tag in
+        // the top bits tells which map a key came from
+        template<typename V>
+        class slot_map
+        {
+        public:
+            static constexpr uint32_t nIndexBits = 20;
+            static constexpr uint32_t nIndexMask = (1u << nIndexBits) - 1;
+            static constexpr uint32_t nGenerationBits = 32;
+            static constexpr uint32_t nMaxTagBits = 64 - nIndexBits - nGenerationBits;
+
+            // nTagBits (at most nMaxTagBits) of the key are used to store nTag
+            explicit slot_map(uint32_t nTagBits = 0, uint32_t nTag = 0)
+                : m_nTagBits(nTagBits), m_nTag(nTag)
+            {
+                if (nTagBits > nMaxTagBits) throw std::length_error("slot_map: tag too wide");
+            }
+
+            // Store a value and return the key that finds it
+            uint64_t insert(V value)
+            {
+                uint32_t nIndex;
+                if (!m_vFreeSlots.empty()) {
+                    nIndex = m_vFreeSlots.back();
+                    m_vFreeSlots.pop_back();
+                } else {
+                    if (m_vSlots.size() > nIndexMask) throw std::length_error("slot_map: out of slots");
+                    nIndex = uint32_t(m_vSlots.size());
+                    m_vSlots.push_back({ 1, npos });
+                }
+
+                m_vSlots[nIndex].nDense = uint32_t(m_vValues.size());
+                m_vValues.push_back(std::move(value));
+                m_vDenseToSlot.push_back(nIndex);
+
+                return make_key(nIndex, m_vSlots[nIndex].nGeneration);
+            }
+
+            // Returns the value for a key, nullptr if the key is stale or unknown
+            V *find(uint64_t nKey)
+            {
+                uint32_t nIndex = uint32_t(nKey & nIndexMask);
+                if (nIndex >= m_vSlots.size() || tag_of(nKey, m_nTagBits) != m_nTag) return nullptr;
+
+                const slot &s = m_vSlots[nIndex];
+                if (s.nDense == npos || s.nGeneration != generation_of(nKey)) return nullptr;
+
+                return &m_vValues[s.nDense];
+            }
+
+            // Removes the value for a key, returns false if the key is stale or unknown
+            bool erase(uint64_t nKey)
+            {
+                if (!find(nKey)) return false;
+
+                uint32_t nIndex = uint32_t(nKey & nIndexMask);
+                slot &s = m_vSlots[nIndex];
+
+                // Keep the values dense by moving the last one into the hole
+                uint32_t nLast = uint32_t(m_vValues.size() - 1);
+                if (s.nDense != nLast) {
+                    m_vValues[s.nDense] = std::move(m_vValues[nLast]);
+                    m_vDenseToSlot[s.nDense] = m_vDenseToSlot[nLast];
+                    m_vSlots[m_vDenseToSlot[s.nDense]].nDense = s.nDense;
+                }
+                m_vValues.pop_back();
+                m_vDenseToSlot.pop_back();
+
+                // Retire the key and put the slot on the free list
+                s.nGeneration++;
+                if (s.nGeneration == 0) s.nGeneration = 1;
+                s.nDense = npos;
+                m_vFreeSlots.push_back(nIndex);
+                return true;
+            }
+
+            // Returns the tag stored in a key by a map created with nTagBits
+            static uint32_t tag_of(uint64_t nKey, uint32_t nTagBits)
+            {
+                return nTagBits == 0 ? 0 : uint32_t(nKey >> (64 - nTagBits));
+            }
+
+            // Key of the value at a position in the dense array
+            uint64_t key_at(size_t nDense) const
+            {
+                uint32_t nIndex = m_vDenseToSlot[nDense];
+                return make_key(nIndex, m_vSlots[nIndex].nGeneration);
+            }
+
+            size_t size() const { return m_vValues.size(); }
+            bool empty() const { return m_vValues.empty(); }
+
+            // Iteration over the dense values
+            typename std::vector<V>::iterator begin() { return m_vValues.begin(); }
+            typename std::vector<V>::iterator end() { return m_vValues.end(); }
+            V &operator [] (size_t nDense) { return m_vValues[nDense]; }
+
+        private:
+            static constexpr uint32_t npos = 0xFFFFFFFF;
+
+            struct slot
+            {
+                // Generation 0 is never used, so no valid key is 0
+                uint32_t nGeneration;
+                // Position in the dense arrays, npos when unused
+                uint32_t nDense;
+            };
+
+            uint64_t make_key(uint32_t nIndex, uint32_t nGeneration) const
+            {
+                uint64_t nKey = (uint64_t(nGeneration) << nIndexBits) | nIndex;
+                if (m_nTagBits > 0) nKey |= uint64_t(m_nTag) << (64 - m_nTagBits);
+                return nKey;
+            }
+
+            static uint32_t generation_of(uint64_t nKey)
+            {
+                return uint32_t(nKey >> nIndexBits);
+            }
+
+            std::vector<slot> m_vSlots;
+            std::vector<V> m_vValues;
+            std::vector<uint32_t> m_vDenseToSlot;
+            std::vector<uint32_t> m_vFreeSlots;
+
+            uint32_t m_nTagBits = 0;
+            uint32_t m_nTag = 0;
+        };
+    }
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "net_common.h"
+#include "net_waitpolicy.h"
 
 namespace kim
 {
@@ -40,6 +41,7 @@ namespace kim
                 std::scoped_lock lock(muxQueue);
                 auto t = std::move(deqQueue.front());
                 deqQueue.pop_front();
+                nItemCount.store(deqQueue.size(), std::memory_order_release);
                 return t;
             }
 
@@ -49,29 +51,47 @@ namespace kim
                 std::scoped_lock lock(muxQueue);
                 auto t = std::move(deqQueue.back());
                 deqQueue.pop_back();
+                nItemCount.store(deqQueue.size(), std::memory_order_release);
                 return t;
             }
 
             // Adds an item to back of queue
             void push_back(const T &item)
             {
-                std::scoped_lock lock(muxQueue);
-                deqQueue.emplace_back(std::move(item));
+                {
+                    std::scoped_lock lock(muxQueue);
+                    deqQueue.emplace_back(std::move(item));
+                    nItemCount.store(deqQueue.size(), std::memory_order_release);
+                }
+
+                // Wake the consumer, which only costs a lock if it is asleep
+                notify();
+            }
+
+            // Moves an item to back of queue
+            void push_back(T &&item)
+            {
+                {
+                    std::scoped_lock lock(muxQueue);
+                    deqQueue.emplace_back(std::move(item));
+                    nItemCount.store(deqQueue.size(), std::memory_order_release);
+                }
 
-                // Signal condition variable to wake up
-                std::unique_lock<std::mutex> ul(muxBlocking);
-                cvBlocking.notify_one();
+                // Wake the consumer, which only costs a lock if it is asleep
+                notify();
             }
 
             // Ands an item to front of queue
             void push_front(const T &item)
             {
-                std::scoped_lock lock(muxQueue);
-                deqQueue.emplace_front(std::move(item));
+                {
+                    std::scoped_lock lock(muxQueue);
+                    deqQueue.emplace_front(std::move(item));
+                    nItemCount.store(deqQueue.size(), std::memory_order_release);
+                }
 
-                // Signal condition variable to wake up
-                std::unique_lock<std::mutex> ul(muxBlocking);
-                cvBlocking.notify_one();
+                // Wake the consumer, which only costs a lock if it is asleep
+                notify();
             }
 
             // Returns true if queue has no items
@@ -93,29 +113,65 @@ namespace kim
             {
                 std::scoped_lock lock(muxQueue);
                 deqQueue.clear();
+                nItemCount.store(0, std::memory_order_release);
             }
 
+            // Takes every queued item in one go by swapping the underlying deque
+            // under a single lock. Anything already in out is discarded
+            size_t drain(std::deque<T> &out)
+            {
+                out.clear();
+                std::scoped_lock lock(muxQueue);
+                deqQueue.swap(out);
+                nItemCount.store(0, std::memory_order_release);
+                return out.size();
+            }
+
+            // Blocks until the queue has an item
             void wait()
             {
-                // Is queue empty or not
-                while (empty()) {
-                    std::unique_lock<std::mutex> ul(muxBlocking);
-                    // Send thread to sleep through condition variable
-                    // Either we wake it up or a spurious wakeup occurs
-                    cvBlocking.wait(ul);
-                }
+                wait(wait_policy::park());
+            }
+
+            // Waits for an item following the policy, returns false if it timed out
+            // The spin and yield phases only read an atomic count, never the mutex
+            bool wait(const wait_policy &policy)
+            {
+                return waiter.wait(policy, [this]() { return nItemCount.load(std::memory_order_acquire) > 0; });
+            }
+
+            // Wake-up latency and CPU measurements of the waits so far
+            wait_stats get_wait_stats() const
+            {
+                return waiter.stats();
+            }
+
+            // Also wake pWaiter on every push, so one consumer can wait on several queues at once.
+            // Set before anything is pushed
+            void set_shared_waiter(queue_waiter *pWaiter)
+            {
+                pSharedWaiter = pWaiter;
             }
 
         protected:
+            void notify()
+            {
+                waiter.notify();
+                if (pSharedWaiter) pSharedWaiter->notify();
+            }
+
             // Double ended queue
             std::deque<T> deqQueue;
             // Mutex to protect the double ended queue
             std::mutex muxQueue;
 
-            // Condition variable
-            std::condition_variable cvBlocking;
-            // Mutex to protect the double ended queue
-            std::mutex muxBlocking;
+            // Number of items, readable without the mutex
+            std::atomic<size_t> nItemCount{ 0 };
+
+            // Puts the consumer to sleep and wakes it up
+            queue_waiter waiter;
+            // Waiter shared with other queues, see set_shared_waiter()
+            queue_waiter *pSharedWaiter = nullptr;
         };
     }
 }
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_connection.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // UDP socket carrying the unreliable messages of a client's connection, or of every
+        // connection of a server. Each datagram starts with the token of the connection it
+        // belongs to, which both ends learn from the handshake, followed by a sequence number
+        // and, unless it is a hello, a message header and body:
+        // [uint64_t token][uint64_t sequence][message_header<T>][body]
+        template<typename T>
+        class udp_channel
+        {
+        public:
+            // Largest datagram sent, so a datagram is never fragmented on an Ethernet path
+            static constexpr size_t nMaxDatagramSize = 1472;
+            static constexpr size_t nPrefixSize = 2 * sizeof(uint64_t);
+
+            udp_channel(asio::io_context &asioContext)
+                : m_socket(asioContext)
+            {
+
+            }
+
+            // Bind the socket, the server to its port and a client to any port
+            // Sends never block: a datagram that does not fit in the socket buffer is dropped
+            void Open(const asio::ip::udp::endpoint &local)
+            {
+                m_socket.open(local.protocol());
+                m_socket.bind(local);
+                m_socket.non_blocking(true);
+            }
+
+            // Start handing received datagrams to the connections bound to their tokens
+            void Start()
+            {
+                Receive();
+            }
+
+            // Close the socket, freeing its port. The pending receive completes as cancelled and
+            // is not issued again, so its handler has to run before the channel goes
+            void Close()
+            {
+                asio::error_code ec;
+                std::scoped_lock lock(m_muxSend);
+                m_socket.close(ec);
+            }
+
+            // Route the datagrams carrying nToken to a connection
+            void Bind(uint64_t nToken, connection<T> *pConnection)
+            {
+                std::scoped_lock lock(m_muxBindings);
+                m_mapBindings[nToken] = pConnection;
+            }
+
+            // Called by a connection as it goes away
+            void Unbind(uint64_t nToken, connection<T> *pConnection)
+            {
+                std::scoped_lock lock(m_muxBindings);
+                auto it = m_mapBindings.find(nToken);
+                if (it != m_mapBindings.end() && it->second == pConnection) m_mapBindings.erase(it);
+            }
+
+            // Send one datagram from any thread. Returns false if it was not sent
+            template<typename ConstBufferSequence>
+            bool SendTo(const ConstBufferSequence &buffers, const asio::ip::udp::endpoint &remote)
+            {
+                asio::error_code ec;
+                {
+                    std::scoped_lock lock(m_muxSend);
+                    m_socket.send_to(buffers, remote, 0, ec);
+                }
+
+                if (ec) {
+                    m_nSendFailures++;
+                    return false;
+                }
+                return true;
+            }
+
+            uint16_t GetPort() const
+            {
+                return m_socket.local_endpoint().port();
+            }
+
+            // Datagrams the socket refused to send, and datagrams received that no connection was bound to
+            uint64_t GetSendFailures() const
+            {
+                return m_nSendFailures;
+            }
+
+            uint64_t GetUnknownCount() const
+            {
+                return m_nUnknownCount;
+            }
+
+        private:
+            // Async - Prime context to receive the next datagram
+            void Receive()
+            {
+                m_socket.async_receive_from(asio::buffer(m_vBuffer), m_remote,
+                    [this](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec && length >= nPrefixSize) {
+                            uint64_t nToken;
+                            std::memcpy(&nToken, m_vBuffer.data(), sizeof(uint64_t));
+
+                            std::scoped_lock lock(m_muxBindings);
+                            auto it = m_mapBindings.find(nToken);
+                            if (it != m_mapBindings.end()) {
+                                it->second->OnDatagram(m_remote, m_vBuffer.data() + sizeof(uint64_t), length - sizeof(uint64_t));
+                            } else {
+                                m_nUnknownCount++;
+                            }
+                        }
+
+                        // Errors such as an ICMP unreachable from an earlier send do not end the channel
+                        if (m_socket.is_open()) Receive();
+                    });
+            }
+
+            asio::ip::udp::socket m_socket;
+
+            // Only one receive is in flight at a time, so these need no lock
+            std::vector<uint8_t> m_vBuffer = std::vector<uint8_t>(64 * 1024);
+            asio::ip::udp::endpoint m_remote;
+
+            // Connections by token. The lock is held while a datagram is handed over, so a connection
+            // that has unbound itself is never called again. It is recursive as the hand-over may
+            // release the last reference to a connection, which then unbinds itself
+            std::unordered_map<uint64_t, connection<T> *> m_mapBindings;
+            std::recursive_mutex m_muxBindings;
+
+            // Senders on different threads take turns on the socket
+            std::mutex m_muxSend;
+
+            std::atomic<uint64_t> m_nSendFailures{ 0 };
+            std::atomic<uint64_t> m_nUnknownCount{ 0 };
+        };
+    }
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "net_common.h"
+
+namespace kim
+{
+    namespace net
+    {
+        // How a consumer waits for a queue to receive an item: check it nSpin times in a tight loop,
+        // then nYield times giving up the time slice in between, then sleep until a producer wakes
+        // it. The wait gives up once the timeout has passed, the default being to wait forever
+        struct wait_policy
+        {
+            size_t nSpin = 0;
+            size_t nYield = 0;
+            std::chrono::microseconds timeout = std::chrono::microseconds::max();
+
+            // Sleep straight away, the original behaviour
+            static wait_policy park()
+            {
+                return wait_policy();
+            }
+
+            // Burn some CPU first for lower wake-up latency
+            static wait_policy spin_then_park(size_t nSpin = 4000, size_t nYield = 100)
+            {
+                wait_policy policy;
+                policy.nSpin = nSpin;
+                policy.nYield = nYield;
+                return policy;
+            }
+        };
+
+        // Measurements taken by a queue_waiter, used to compare wait policies
+        struct wait_stats
+        {
+            // Number of waits that found the queue empty
+            uint64_t nWaits = 0;
+            // How those waits ended
+            uint64_t nSpinWakeups = 0;
+            uint64_t nYieldWakeups = 0;
+            uint64_t nParkWakeups = 0;
+            uint64_t nTimeouts = 0;
+            // Total time from the waking push to the sleeping consumer running again
+            uint64_t nWakeLatencyNs = 0;
+            // Total time burnt spinning and yielding, i.e. CPU spent waiting
+            uint64_t nBusyNs = 0;
+            // Total time spent asleep
+            uint64_t nParkedNs = 0;
+            // Number of times a producer had to take the lock to wake the consumer
+            uint64_t nNotifies = 0;
+        };
+
+        // Waiting and waking logic shared by the queues. Producers only take the mutex and
+        // notify when a consumer has announced it is asleep, so pushing to a queue whose
+        // consumer is busy or spinning costs a fence and an atomic load
+        class queue_waiter
+        {
+        public:
+            // Producer side - call after an item has been published
+            void notify()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_nSleepers.load(std::memory_order_relaxed) > 0) {
+                    m_nLastNotifyNs.store(now_ns(), std::memory_order_relaxed);
+
+                    std::unique_lock<std::mutex> ul(muxBlocking);
+                    cvBlocking.notify_all();
+                    m_nNotifies.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            // Consumer side - wait until hasItem() returns true or the policy times out
+            template<typename Predicate>
+            bool wait(const wait_policy &policy, Predicate hasItem)
+            {
+                if (hasItem()) return true;
+
+                m_nWaits.fetch_add(1, std::memory_order_relaxed);
+
+                const bool bForever = policy.timeout == std::chrono::microseconds::max();
+                const auto tStart = std::chrono::steady_clock::now();
+                const auto tDeadline = bForever ? tStart : tStart + policy.timeout;
+
+                for (size_t i = 0; i < policy.nSpin; i++) {
+                    if (hasItem()) return woke(m_nSpinWakeups, tStart);
+                }
+
+                for (size_t i = 0; i < policy.nYield; i++) {
+                    std::this_thread::yield();
+                    if (hasItem()) return woke(m_nYieldWakeups, tStart);
+                    if (!bForever && std::chrono::steady_clock::now() >= tDeadline) return timed_out(tStart);
+                }
+
+                const auto tPark = std::chrono::steady_clock::now();
+                add_ns(m_nBusyNs, tStart, tPark);
+
+                std::unique_lock<std::mutex> ul(muxBlocking);
+                m_nSleepers.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                // A producer that published before seeing the sleeper count will not notify, so check again
+                bool bReady = true;
+                while (!hasItem()) {
+                    if (bForever) {
+                        cvBlocking.wait(ul);
+                    } else if (cvBlocking.wait_until(ul, tDeadline) == std::cv_status::timeout) {
+                        bReady = hasItem();
+                        break;
+                    }
+                }
+
+                m_nSleepers.fetch_sub(1, std::memory_order_relaxed);
+                ul.unlock();
+
+                const auto tWake = std::chrono::steady_clock::now();
+                add_ns(m_nParkedNs, tPark, tWake);
+
+                if (!bReady) {
+                    m_nTimeouts.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+
+                m_nParkWakeups.fetch_add(1, std::memory_order_relaxed);
+
+                // Wake-up latency is measured from the notify that ended this sleep
+                int64_t nNotify = m_nLastNotifyNs.load(std::memory_order_relaxed);
+                int64_t nWake = std::chrono::duration_cast<std::chrono::nanoseconds>(tWake.time_since_epoch()).count();
+                if (nNotify > std::chrono::duration_cast<std::chrono::nanoseconds>(tPark.time_since_epoch()).count() && nWake > nNotify) {
+                    m_nWakeLatencyNs.fetch_add(uint64_t(nWake - nNotify), std::memory_order_relaxed);
+                }
+
+                return true;
+            }
+
+            wait_stats stats() const
+            {
+                wait_stats s;
+                s.nWaits = m_nWaits.load(std::memory_order_relaxed);
+                s.nSpinWakeups = m_nSpinWakeups.load(std::memory_order_relaxed);
+                s.nYieldWakeups = m_nYieldWakeups.load(std::memory_order_relaxed);
+                s.nParkWakeups = m_nParkWakeups.load(std::memory_order_relaxed);
+                s.nTimeouts = m_nTimeouts.load(std::memory_order_relaxed);
+                s.nWakeLatencyNs = m_nWakeLatencyNs.load(std::memory_order_relaxed);
+                s.nBusyNs = m_nBusyNs.load(std::memory_order_relaxed);
+                s.nParkedNs = m_nParkedNs.load(std::memory_order_relaxed);
+                s.nNotifies = m_nNotifies.load(std::memory_order_relaxed);
+                return s;
+            }
+
+        private:
+            static int64_t now_ns()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            static void add_ns(std::atomic<uint64_t> &nTotal, std::chrono::steady_clock::time_point tFrom, std::chrono::steady_clock::time_point tTo)
+            {
+                nTotal.fetch_add(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(tTo - tFrom).count()), std::memory_order_relaxed);
+            }
+
+            bool woke(std::atomic<uint64_t> &nCounter, std::chrono::steady_clock::time_point tStart)
+            {
+                nCounter.fetch_add(1, std::memory_order_relaxed);
+                add_ns(m_nBusyNs, tStart, std::chrono::steady_clock::now());
+                return true;
+            }
+
+            bool timed_out(std::chrono::steady_clock::time_point tStart)
+            {
+                m_nTimeouts.fetch_add(1, std::memory_order_relaxed);
+                add_ns(m_nBusyNs, tStart, std::chrono::steady_clock::now());
+                return false;
+            }
+
+            // Consumers currently asleep on the condition variable
+            std::atomic<uint32_t> m_nSleepers{ 0 };
+            // When a producer last woke a sleeper, for wake-up latency
+            std::atomic<int64_t> m_nLastNotifyNs{ 0 };
+
+            // Condition variable
+            std::condition_variable cvBlocking;
+            // Mutex used only to sleep and wake the consumer
+            std::mutex muxBlocking;
+
+            std::atomic<uint64_t> m_nWaits{ 0 };
+            std::atomic<uint64_t> m_nSpinWakeups{ 0 };
+            std::atomic<uint64_t> m_nYieldWakeups{ 0 };
+            std::atomic<uint64_t> m_nParkWakeups{ 0 };
+            std::atomic<uint64_t> m_nTimeouts{ 0 };
+            std::atomic<uint64_t> m_nWakeLatencyNs{ 0 };
+            std::atomic<uint64_t> m_nBusyNs{ 0 };
+            std::atomic<uint64_t> m_nParkedNs{ 0 };
+            std::atomic<uint64_t> m_nNotifies{ 0 };
+        };
+    }
+}
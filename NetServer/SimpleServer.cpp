@@ -36,25 +36,35 @@ protected:
     // Called when a message arrives
     virtual void OnMessage(std::shared_ptr<kim::net::connection<CustomMsgTypes>> client, kim::net::message<CustomMsgTypes> &msg)
     {
-        switch (msg.header.id) {
-            case CustomMsgTypes::ServerPing:
-                std::cout << "[" << client->GetID() << "]: Server Ping\n";
+        // Straight to the handler bound to the id, anything else is dropped
+        if (!handlers::dispatch(*this, client, msg)) {
+            std::cout << "[" << client->GetID() << "]: Unexpected Message " << msg << "\n";
+        }
+    }
 
-                // Simply bounce message back to client
-                client->Send(msg);
-                break;
+    void OnServerPing(std::shared_ptr<kim::net::connection<CustomMsgTypes>> client, kim::net::message<CustomMsgTypes> &msg)
+    {
+        std::cout << "[" << client->GetID() << "]: Server Ping\n";
+
+        // Simply bounce message back to client
+        client->Send(msg);
+    }
 
-            case CustomMsgTypes::MessageAll:
-                std::cout << "[" << client->GetID() << "]: Message All\n";
+    void OnMessageAll(std::shared_ptr<kim::net::connection<CustomMsgTypes>> client)
+    {
+        std::cout << "[" << client->GetID() << "]: Message All\n";
 
-                // Construct a new message and send it to all clients
-                kim::net::message<CustomMsgTypes> msg;
-                msg.header.id = CustomMsgTypes::ServerMessage;
-                msg << client->GetID();
-                MessageAllClients(msg, client);
-                break;
-        }
+        // Construct a new message and send it to all clients
+        kim::net::message<CustomMsgTypes> msg;
+        msg.header.id = CustomMsgTypes::ServerMessage;
+        msg << client->GetID();
+        MessageAllClients(msg, client);
     }
+
+    // Handler of each message id a client may send, looked up by the id's value
+    using handlers = kim::net::message_table<CustomMsgTypes, CustomServer,
+        kim::net::on_message<CustomMsgTypes::ServerPing, &CustomServer::OnServerPing>,
+        kim::net::on_message<CustomMsgTypes::MessageAll, &CustomServer::OnMessageAll>>;
 };
 
 int main()